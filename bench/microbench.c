@@ -0,0 +1,343 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// Times the building blocks of ngram2vec on a corpus, for example one written by zipf.c. The
+// trainer is compiled in, so the functions timed are exactly those of ngram2vec.c.
+//
+//   gcc -O3 bench/microbench.c -o microbench -lm -pthread
+//   ./microbench -train corpus.txt -ngrams 2
+
+#define main ngram2vec_main
+#include "../ngram2vec.c"
+#undef main
+
+#define MAX_TOKENS 10000000            // Tokens kept in memory for the lookup benchmarks
+
+char **tokens;
+int *token_lens;
+long long token_count;
+
+// Prints one result line: the name, the operations done and their rate
+void Report(const char *name, long long ops, const char *unit, double seconds) {
+  printf("%-28s %12lld %-10s %8.3f s %10.2f M%s/s\n", name, ops, unit, seconds, ops / seconds / 1e6, unit);
+}
+
+void BenchReadWord() {
+  char word[MAX_STRING];
+  long long n = 0;
+  double t = Now();
+  FILE *fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  while (1) {
+    ReadWord(word, fin);
+    if (feof(fin)) break;
+    n++;
+  }
+  fclose(fin);
+  Report("ReadWord", n, "tokens", Now() - t);
+}
+
+// Also keeps the first MAX_TOKENS tokens for the lookups
+void BenchReadToken() {
+  struct token_reader tr;
+  long long size, n = 0;
+  int len;
+  char *word, *text = MapFile(train_file, &size);
+  double t = Now();
+  tr.pos = text;
+  tr.end = text + size;
+  while ((word = ReadToken(&tr, &len)) != NULL) n++;
+  Report("ReadToken", n, "tokens", Now() - t);
+  tokens = (char **)malloc(MAX_TOKENS * sizeof(char *));
+  token_lens = (int *)malloc(MAX_TOKENS * sizeof(int));
+  tr.pos = text;
+  for (token_count = 0; token_count < MAX_TOKENS && (word = ReadToken(&tr, &len)) != NULL; token_count++) {
+    tokens[token_count] = word;
+    token_lens[token_count] = len;
+  }
+}
+
+// Adds the distinct words of the kept tokens to an empty vocabulary. The vocabulary is emptied
+// again for LearnVocabFromTrainFile
+void BenchAddWordToVocab() {
+  char word[MAX_STRING];
+  long long a, n = 0;
+  double t;
+  struct ngram_table seen;
+  InitTable(&seen, 1 << 20, 0, 1LL << 40);
+  for (a = 0; a < token_count; a++) {
+    unsigned long long hash = HashString(tokens[a], token_lens[a]);
+    AddWordToTable(&seen, tokens[a], token_lens[a], hash);
+  }
+  t = Now();
+  for (a = 0; a < seen.size; a++) {
+    strcpy(word, TableWord(&seen, a));
+    AddWordToVocab(word);
+    n++;
+  }
+  Report("AddWordToVocab", n, "words", Now() - t);
+  FreeTable(&seen);
+  ngram_size = vocab_size = 0;
+  vocab_strings.size = 0;
+}
+
+void BenchLearnVocab() {
+  double t = Now(), sorted = phase_time[PHASE_SORT];
+  int debug = debug_mode;
+  debug_mode = 0;
+  LearnVocabFromTrainFile();
+  debug_mode = debug;
+  Report("LearnVocabFromTrainFile", total_words, "words", Now() - t);
+  Report("  of which SortNgram", ngram_size, "entries", phase_time[PHASE_SORT] - sorted);
+  printf("%-28s %12lld words, %lld ngrams\n", "  vocabulary", vocab_size, ngram_size - vocab_size);
+}
+
+void BenchSearchVocab() {
+  long long a, found = 0;
+  double t = Now();
+  for (a = 0; a < token_count; a++) found += SearchVocab(tokens[a], token_lens[a]) >= 0;
+  Report("SearchVocab", token_count, "lookups", Now() - t);
+  if (found == 0) printf("  (no token found)\n");
+}
+
+// Counts the ngrams of order 2 of the kept tokens in a SpaceSaving table (the bounded counting
+// that replaced ReduceNgram), once with room for all of them and once with room for 1/10
+void BenchCountNgram() {
+  struct ngram_table table;
+  long long a, distinct = 0, capacity, round;
+  int wids[2];
+  double t;
+  if (ngrams < 2) return;
+  for (round = 0; round < 2; round++) {
+    capacity = round == 0 ? 1LL << 40 : distinct / 10 + 1;
+    InitTable(&table, 1 << 16, 1, capacity);
+    wids[1] = -1;
+    t = Now();
+    for (a = 0; a < token_count; a++) {
+      wids[0] = wids[1];
+      wids[1] = SearchVocab(tokens[a], token_lens[a]);
+      if (wids[0] < 0 || wids[1] < 0) continue;
+      CountNgram(&table, wids, 2, HashNgram(wids, 2));
+    }
+    Report(round == 0 ? "CountNgram (room for all)" : "CountNgram (room for 1/10)", token_count, "tokens", Now() - t);
+    distinct = table.size;
+    FreeTable(&table);
+  }
+}
+
+void BenchCreateBinaryTree() {
+  int a, reps = 5;
+  double t = Now();
+  for (a = 0; a < reps; a++) CreateBinaryTree();
+  Report("CreateBinaryTree", reps * vocab_size, "words", Now() - t);
+}
+
+void BenchInitUnigramTable() {
+  int a, reps = 5;
+  double t = Now();
+  for (a = 0; a < reps; a++) {
+    free(alias_table);
+    InitUnigramTable();
+  }
+  Report("InitUnigramTable", reps * vocab_size, "words", Now() - t);
+}
+
+// Checks the alias table of InitUnigramTable against the exact unigram^0.75 distribution, with
+// </s> replaced by a uniform word as SampleNegative does: first the probabilities the table
+// implies, then a chi-square test of 'draws' samples. Bins expected to get fewer than 5 samples
+// are pooled. The test fails if the chi-square is more than 4 standard deviations from its mean
+void CheckSampler(long long draws) {
+  double *exact = (double *)malloc(vocab_size * sizeof(double)), *implied = (double *)calloc(vocab_size, sizeof(double));
+  long long *seen = (long long *)calloc(vocab_size, sizeof(long long));
+  long long a, bins = 0;
+  unsigned long long next_random = 1;
+  double total = 0, err, max_err = 0, chi2 = 0, pooled_expected = 0, pooled_seen = 0, z;
+  struct alias_table *t = alias_table;
+  for (a = 0; a < vocab_size; a++) total += exact[a] = pow(ngram_infos[a].cn, 0.75);
+  for (a = 1; a < vocab_size; a++) exact[a] = (exact[a] + exact[0] / (vocab_size - 1)) / total;
+  exact[0] = 0;
+  for (a = 0; a < vocab_size; a++) {
+    implied[a] += t->slot[a].cut / (double)(1 << 24) / vocab_size;
+    implied[t->slot[a].alias] += (1 - t->slot[a].cut / (double)(1 << 24)) / vocab_size;
+  }
+  for (a = 1; a < vocab_size; a++) implied[a] += implied[0] / (vocab_size - 1);
+  for (a = 1; a < vocab_size; a++) {
+    err = fabs(implied[a] - exact[a]) / exact[a];
+    if (err > max_err) max_err = err;
+  }
+  for (a = 0; a < draws; a++) seen[SampleNegative(&next_random)]++;
+  for (a = 1; a < vocab_size; a++) {
+    if (exact[a] * draws < 5) {
+      pooled_expected += exact[a] * draws;
+      pooled_seen += seen[a];
+      continue;
+    }
+    chi2 += (seen[a] - exact[a] * draws) * (seen[a] - exact[a] * draws) / (exact[a] * draws);
+    bins++;
+  }
+  if (pooled_expected > 0) {
+    chi2 += (pooled_seen - pooled_expected) * (pooled_seen - pooled_expected) / pooled_expected;
+    bins++;
+  }
+  z = (chi2 - (bins - 1)) / sqrt(2.0 * (bins - 1));
+  printf("%-28s max relative error of the table %.2e\n", "sampler check", max_err);
+  printf("%-28s chi-square %.0f over %lld bins of %lld draws, z = %.2f: %s\n", "", chi2, bins, draws, z,
+         fabs(z) < 4 && seen[0] == 0 ? "PASS" : "FAIL");
+  free(exact);
+  free(implied);
+  free(seen);
+}
+
+// One skip-gram step with negative sampling: a context ngram against a word and its negatives,
+// as in TrainModelThread, with every kernel the CPU has
+void BenchSkipGram() {
+  const char *names[4] = {"scalar", "sse2", "avx2", "avx512"};
+  char name[MAX_STRING], label[64];
+  int *rows = (int *)malloc((negative + 1) * sizeof(int));
+  real *labels = (real *)malloc((negative + 1) * sizeof(real));
+  real *fs = (real *)malloc((negative + 1) * sizeof(real)), *ss = (real *)malloc((negative + 1) * sizeof(real));
+  real *neu1e = (real *)calloc(layer1_size, sizeof(real));
+  unsigned long long next_random = 1;
+  long long a, l1, steps = 2000000, d;
+  int k;
+  double t;
+  for (k = 0; k < 4; k++) {
+    strcpy(name, names[k]);
+#if defined(__x86_64__) || defined(__i386__)
+    if ((k == 1 && !__builtin_cpu_supports("sse2")) || (k == 2 && !(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")))
+        || (k == 3 && !__builtin_cpu_supports("avx512f"))) continue;
+#else
+    if (k > 0) continue;
+#endif
+    InitKernels(name);
+    t = Now();
+    for (a = 0; a < steps; a++) {
+      rows[0] = SampleNegative(&next_random);
+      labels[0] = 1;
+      for (d = 1; d <= negative; d++) {
+        rows[d] = SampleNegative(&next_random);
+        labels[d] = 0;
+      }
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      l1 = (long long)((next_random >> 16) % ngram_size) * layer1_size;
+      memset(neu1e, 0, layer1_size * sizeof(real));
+      TrainOutputs(syn0 + l1, syn1neg, NULL, rows, labels, negative + 1, 0, neu1e, fs, ss, alpha);
+      Axpy(syn0 + l1, 1, neu1e, layer1_size);
+    }
+    sprintf(label, "skip-gram step (%s)", name);
+    Report(label, steps, "pairs", Now() - t);
+  }
+  free(rows);
+  free(labels);
+  free(fs);
+  free(ss);
+  free(neu1e);
+}
+
+// One hierarchical softmax step: a context ngram against the Huffman path of a word drawn from
+// the unigram distribution, as in TrainModelThread, with the best kernel
+void BenchHierarchicalSoftmax() {
+  real *labels = (real *)malloc(MAX_CODE_LENGTH * sizeof(real));
+  real *fs = (real *)malloc(MAX_CODE_LENGTH * sizeof(real)), *ss = (real *)malloc(MAX_CODE_LENGTH * sizeof(real));
+  real *neu1e = (real *)calloc(layer1_size, sizeof(real));
+  unsigned long long next_random = 1;
+  long long a, l1, steps = 2000000, nodes = 0, y;
+  int d;
+  double t;
+  char name[MAX_STRING] = "auto";
+  InitKernels(name);
+  t = Now();
+  for (a = 0; a < steps; a++) {
+    y = SampleNegative(&next_random);
+    for (d = 0; d < ngram_infos[y].codelen; d++) labels[d] = 1 - (real)((vocab_codes[y] >> d) & 1);
+    nodes += ngram_infos[y].codelen;
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    l1 = (long long)((next_random >> 16) % ngram_size) * layer1_size;
+    memset(neu1e, 0, layer1_size * sizeof(real));
+    TrainOutputs(syn0 + l1, syn1, NULL, vocab_points + y * MAX_CODE_LENGTH, labels, ngram_infos[y].codelen, 1, neu1e, fs, ss, alpha);
+    Axpy(syn0 + l1, 1, neu1e, layer1_size);
+  }
+  t = Now() - t;
+  Report("hierarchical softmax step", steps, "pairs", t);
+  printf("%-28s %12.2f nodes per pair, %lld words\n", "", nodes / (double)steps, vocab_size);
+  free(labels);
+  free(fs);
+  free(ss);
+  free(neu1e);
+}
+
+int main(int argc, char **argv) {
+  int i;
+  long long check_draws = 0;
+  if (argc == 1) {
+    printf("Microbenchmarks of ngram2vec\n\n");
+    printf("Options:\n");
+    printf("\t-train <file>\n");
+    printf("\t\tCorpus to read, count and look up, e.g. from zipf.c\n");
+    printf("\t-ngrams <int>\n");
+    printf("\t\tOrder of the ngrams; default is 2\n");
+    printf("\t-size <int>\n");
+    printf("\t\tSize of the vectors for the skip-gram step; default is 100\n");
+    printf("\t-negative <int>\n");
+    printf("\t\tNegative examples per skip-gram step; default is 5\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tThreads of the vocabulary pass and the unigram table; default is 1\n");
+    printf("\t-check-sampler <int>\n");
+    printf("\t\tAlso check the negative sampler against the exact distribution with <int> draws; default is 0 (off)\n");
+    printf("\nExamples:\n");
+    printf("./microbench -train corpus.txt -ngrams 2\n");
+    printf("./microbench -train corpus.txt -check-sampler 20000000\n\n");
+    return 0;
+  }
+  ngrams = 2;
+  negative = 5;
+  hs = 1;
+  num_threads = 1;
+  if ((i = ArgPos((char *)"-train", argc, argv)) > 0) PathArg(train_file, argv[i + 1], (char *)"-train");
+  if ((i = ArgPos((char *)"-ngrams", argc, argv)) > 0) ngrams = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-check-sampler", argc, argv)) > 0) check_draws = atoll(argv[i + 1]);
+  if (ngrams < 1 || ngrams > MAX_NGRAM || negative < 1) {
+    printf("ERROR: -ngrams must be between 1 and %d and -negative positive\n", MAX_NGRAM);
+    return 1;
+  }
+  ngram_infos = (struct ngram_info *)calloc(ngram_max_size, sizeof(struct ngram_info));
+  ngram_words = (int *)calloc(ngram_max_size * ngrams, sizeof(int));
+  expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
+  for (i = 0; i < EXP_TABLE_SIZE; i++) {
+    expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP);
+    expTable[i] = expTable[i] / (expTable[i] + 1);
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#endif
+  BenchReadWord();
+  BenchReadToken();
+  BenchAddWordToVocab();
+  BenchLearnVocab();
+  BenchSearchVocab();
+  BenchCountNgram();
+  InitNet();
+  BenchCreateBinaryTree();
+  BenchInitUnigramTable();
+  if (check_draws > 0) CheckSampler(check_draws);
+  BenchSkipGram();
+  BenchHierarchicalSoftmax();
+  return 0;
+}
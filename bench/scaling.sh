@@ -0,0 +1,45 @@
+#!/bin/bash
+# End to end scaling of ngram2vec on a synthetic Zipf corpus: trains once for every number of
+# threads and ngram order, and prints the training words per second and the peak memory of each
+# run, read from the last line of its -metrics file. MODES lists extra options of ngram2vec to
+# compare, separated by commas, e.g. the -hot-rows mode against plain Hogwild:
+#
+#   bench/scaling.sh [words] [vocab] [threads...]
+#   MODES="-hot-rows 0,-hot-rows 256" bench/scaling.sh 10000000 100000 1 2 4 8 16 32 64
+#
+# The binaries are built in bench/build and the corpus is kept there, so a second run with the
+# same arguments trains on the same text.
+
+set -e
+cd "$(dirname "$0")"
+WORDS=${1:-10000000}
+VOCAB=${2:-100000}
+shift 2 2>/dev/null || shift $#
+THREADS=${@:-1 2 4 8}
+NGRAMS=${NGRAMS:-1 2 3}
+MODES=${MODES:-}
+DIR=build
+mkdir -p $DIR
+gcc -O3 zipf.c -o $DIR/zipf -lm
+gcc -O3 ../ngram2vec.c -o $DIR/ngram2vec -lpthread -lm
+CORPUS=$DIR/z$WORDS-$VOCAB.txt
+[ -f $CORPUS ] || $DIR/zipf -words $WORDS -vocab $VOCAB > $CORPUS
+
+printf "%-20s %-8s %-8s %14s %12s %10s\n" mode threads ngrams words/sec peak_MB train_s
+IFS=, read -ra MODE_LIST <<< "${MODES:-default}"
+for mode in "${MODE_LIST[@]}"; do
+  [ "$mode" = default ] && args= || args=$mode
+  for n in $NGRAMS; do
+    for t in $THREADS; do
+      rm -f $DIR/metrics.jsonl
+      $DIR/ngram2vec -train $CORPUS -output $DIR/vectors.bin -binary 1 -ngrams $n -threads $t -iter 1 \
+        -debug 0 -metrics $DIR/metrics.jsonl $args > /dev/null
+      last=$(tail -n 1 $DIR/metrics.jsonl)
+      rate=$(echo "$last" | grep -o '"words_per_sec": [0-9.]*' | cut -d' ' -f2)
+      rss=$(echo "$last" | grep -o '"max_rss_kb": [0-9]*' | cut -d' ' -f2)
+      train=$(echo "$last" | grep -o '"train": [0-9.]*' | cut -d' ' -f2)
+      printf "%-20s %-8s %-8s %14.0f %12d %10.2f\n" "$mode" $t $n $rate $((rss / 1024)) $train
+    done
+  done
+done
+rm -f $DIR/vectors.bin $DIR/metrics.jsonl
@@ -0,0 +1,120 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// Writes a synthetic corpus whose word frequencies follow Zipf's law, for benchmarks. The same
+// arguments always give the same corpus.
+//
+//   gcc -O2 bench/zipf.c -o zipf -lm
+//   ./zipf -words 10000000 -vocab 100000 > corpus.txt
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+long long words = 1000000, vocab = 100000, seed = 1;
+double exponent = 1.0, repeat = 0.3;
+int min_length = 3, max_length = 40;
+double *cdf;
+unsigned long long next_random;
+
+double Random() {
+  next_random = next_random * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (next_random >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Returns the rank of a word drawn from the Zipf distribution
+long long DrawWord() {
+  double r = Random();
+  long long lo = 0, hi = vocab - 1, mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (cdf[mid] < r) lo = mid + 1; else hi = mid;
+  }
+  return lo;
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  long long a, n = 0, w, prev, length;
+  double sum = 0;
+  char buf[1 << 16];
+  int i, len = 0;
+  if (argc == 1) {
+    printf("Synthetic Zipf corpus generator\n\n");
+    printf("Options:\n");
+    printf("\t-words <int>\n");
+    printf("\t\tNumber of words to write; default is 1000000\n");
+    printf("\t-vocab <int>\n");
+    printf("\t\tNumber of distinct words; default is 100000\n");
+    printf("\t-exponent <float>\n");
+    printf("\t\tThe word of rank r has a frequency proportional to 1 / r^exponent; default is 1.0\n");
+    printf("\t-repeat <float>\n");
+    printf("\t\tProbability that a word is a fixed function of the previous one, so that ngrams repeat; default is 0.3\n");
+    printf("\t-min-length <int>, -max-length <int>\n");
+    printf("\t\tRange of the sentence lengths; default is 3 to 40\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tSeed of the generator; default is 1\n");
+    printf("\nExamples:\n");
+    printf("./zipf -words 10000000 -vocab 100000 > corpus.txt\n\n");
+    return 0;
+  }
+  if ((i = ArgPos((char *)"-words", argc, argv)) > 0) words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab", argc, argv)) > 0) vocab = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-exponent", argc, argv)) > 0) exponent = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-repeat", argc, argv)) > 0) repeat = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-min-length", argc, argv)) > 0) min_length = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-max-length", argc, argv)) > 0) max_length = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) seed = atoll(argv[i + 1]);
+  if (vocab < 1 || min_length < 1 || max_length < min_length) {
+    printf("ERROR: -vocab and the sentence lengths must be positive\n");
+    return 1;
+  }
+  next_random = seed;
+  cdf = (double *)malloc(vocab * sizeof(double));
+  if (cdf == NULL) {
+    printf("Memory allocation failed\n");
+    return 1;
+  }
+  for (a = 0; a < vocab; a++) cdf[a] = sum += 1 / pow(a + 1, exponent);
+  for (a = 0; a < vocab; a++) cdf[a] /= sum;
+  while (n < words) {
+    length = min_length + (long long)(Random() * (max_length - min_length + 1));
+    for (a = 0, prev = -1; a < length && n < words; a++, n++) {
+      if (prev >= 0 && Random() < repeat) w = (prev * 7 + 3) % (vocab < 200 ? vocab : 200);
+      else w = DrawWord();
+      len += sprintf(buf + len, a ? " w%lld" : "w%lld", w);
+      if (len > (int)sizeof(buf) - 64) {
+        fwrite(buf, 1, len, stdout);
+        len = 0;
+      }
+      prev = w;
+    }
+    buf[len++] = '\n';
+  }
+  fwrite(buf, 1, len, stdout);
+  free(cdf);
+  return 0;
+}
@@ -0,0 +1,205 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "knn.h"
+
+#define MAX_STRING 2000
+
+int k = 40, threads = 1, nprobe = 8, iters = 10;
+long long nlist = 0, bench = 0;
+char vectors_file[MAX_STRING], read_index_file[MAX_STRING], save_index_file[MAX_STRING];
+struct knn_index ix;
+
+double Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Makes the query of a line: the vector of the ngram if the line is one, or of its bucket if the
+// file has buckets, or else the sum of the vectors of its words (separated by spaces). Returns 0
+// if none of them is known
+int MakeQuery(char *line, float *query) {
+  char *word, *save;
+  long long a, b, found = 0;
+  const float *v;
+  memset(query, 0, ix.stride * sizeof(float));
+  if ((a = KnnFind(&ix, line)) >= 0) {
+    memcpy(query, KnnVector(&ix, a), ix.stride * sizeof(float));
+    return 1;
+  }
+  if ((v = KnnBucket(&ix, line)) != NULL) {
+    memcpy(query, v, ix.stride * sizeof(float));
+    return 1;
+  }
+  for (word = strtok_r(line, " ", &save); word != NULL; word = strtok_r(NULL, " ", &save)) {
+    if ((a = KnnFind(&ix, word)) < 0) {
+      printf("Out of dictionary word: %s\n", word);
+      continue;
+    }
+    v = KnnVector(&ix, a);
+    for (b = 0; b < ix.dim; b++) query[b] += v[b];
+    found++;
+  }
+  return found > 0;
+}
+
+// Answers the lines of stdin, like the distance tool of word2vec
+void Interactive() {
+  char line[MAX_STRING];
+  float *query = (float *)aligned_alloc(64, ix.stride * sizeof(float)), *scores = (float *)malloc(k * sizeof(float)), len;
+  long long a, b, *ids = (long long *)malloc(k * sizeof(long long));
+  while (1) {
+    printf("Enter word or ngram (EXIT to break): ");
+    fflush(stdout);
+    if (fgets(line, MAX_STRING, stdin) == NULL) break;
+    line[strcspn(line, "\r\n")] = 0;
+    if (!strcmp(line, "EXIT")) break;
+    if (!MakeQuery(line, query)) continue;
+    for (b = 0, len = 0; b < ix.dim; b++) len += query[b] * query[b];
+    if (len == 0) continue;
+    for (b = 0, len = sqrtf(len); b < ix.dim; b++) query[b] /= len;
+    if (ix.nlist) KnnSearchIvf(&ix, query, 1, k, nprobe, ids, scores, threads);
+    else KnnSearch(&ix, query, 1, k, ids, scores, threads);
+    printf("\n                                              Ngram       Cosine distance\n------------------------------------------------------------------------\n");
+    for (a = 0; a < k && ids[a] >= 0; a++) printf("%50s\t\t%f\n", KnnName(&ix, ids[a]), scores[a]);
+  }
+  free(query);
+  free(scores);
+  free(ids);
+}
+
+// Queries bench random rows with the exact scan and, if there are lists, with them; prints the
+// queries per second and the recall of the lists: the share of the exact k neighbours they find
+void Bench() {
+  float *queries = (float *)aligned_alloc(64, bench * ix.stride * sizeof(float));
+  float *scores = (float *)malloc(bench * k * sizeof(float));
+  long long a, b, c, found = 0, total = 0;
+  long long *exact = (long long *)malloc(bench * k * sizeof(long long)), *approx = (long long *)malloc(bench * k * sizeof(long long));
+  unsigned long long next_random = 1;
+  double t;
+  if (queries == NULL || scores == NULL || exact == NULL || approx == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < bench; a++) {
+    next_random = next_random * 25214903917ULL + 11;
+    memcpy(queries + a * ix.stride, KnnVector(&ix, (next_random >> 16) % ix.rows), ix.stride * sizeof(float));
+  }
+  t = Now();
+  KnnSearch(&ix, queries, bench, k, exact, scores, threads);
+  t = Now() - t;
+  printf("exact (%s): %lld queries in %.3f s, %.1f queries/s\n", KnnKernel(), bench, t, bench / t);
+  if (ix.nlist > 0) {
+    t = Now();
+    KnnSearchIvf(&ix, queries, bench, k, nprobe, approx, scores, threads);
+    t = Now() - t;
+    for (a = 0; a < bench; a++) for (b = 0; b < k; b++) {
+      if (exact[a * k + b] < 0) continue;
+      total++;
+      for (c = 0; c < k; c++) if (approx[a * k + c] == exact[a * k + b]) {found++; break;}
+    }
+    printf("ivf (%lld lists, nprobe %d): %lld queries in %.3f s, %.1f queries/s, recall@%d %.4f\n",
+           ix.nlist, nprobe, bench, t, bench / t, k, found / (double)(total + !total));
+  }
+  free(queries);
+  free(scores);
+  free(exact);
+  free(approx);
+}
+
+int ArgPos(char *str, int argc, char **argv) {
+  int a;
+  for (a = 1; a < argc; a++) if (!strcmp(str, argv[a])) {
+    if (a == argc - 1) {
+      printf("Argument missing for %s\n", str);
+      exit(1);
+    }
+    return a;
+  }
+  return -1;
+}
+
+int main(int argc, char **argv) {
+  int i;
+  double t;
+  if (argc < 2) {
+    printf("Nearest ngrams of the vectors of ngram2vec, by cosine\n\n");
+    printf("Usage: ./distance <FILE> [options]\nwhere FILE is the text output or a -binary 2 output of ngram2vec\n\n");
+    printf("Options:\n");
+    printf("\t-k <int>\n");
+    printf("\t\tNumber of neighbours; default is 40\n");
+    printf("\t-threads <int>\n");
+    printf("\t\tUse <int> threads (default 1)\n");
+    printf("\t-nlist <int>\n");
+    printf("\t\tCluster the ngrams into <int> lists and only search the closest ones; default is 0 (exact search)\n");
+    printf("\t-iters <int>\n");
+    printf("\t\tRounds of k-means for -nlist; default is 10\n");
+    printf("\t-nprobe <int>\n");
+    printf("\t\tLists searched per query; default is 8\n");
+    printf("\t-save-index <file>\n");
+    printf("\t\tSave the lists to <file>\n");
+    printf("\t-read-index <file>\n");
+    printf("\t\tRead the lists from <file> instead of clustering\n");
+    printf("\t-bench <int>\n");
+    printf("\t\tInstead of reading queries, time <int> random ngrams as queries and print the recall of the lists\n");
+    printf("\nExamples:\n");
+    printf("./distance vec.txt\n");
+    printf("./distance vec.bin -nlist 1024 -save-index vec.ivf -bench 1000\n\n");
+    return 0;
+  }
+  strcpy(vectors_file, argv[1]);
+  read_index_file[0] = 0;
+  save_index_file[0] = 0;
+  if ((i = ArgPos((char *)"-k", argc, argv)) > 0) k = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-nlist", argc, argv)) > 0) nlist = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-iters", argc, argv)) > 0) iters = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-nprobe", argc, argv)) > 0) nprobe = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-index", argc, argv)) > 0) strcpy(save_index_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-read-index", argc, argv)) > 0) strcpy(read_index_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-bench", argc, argv)) > 0) bench = atoll(argv[i + 1]);
+  if (k < 1 || nprobe < 1) {
+    printf("ERROR: -k and -nprobe must be positive\n");
+    return 1;
+  }
+  t = Now();
+  if (!KnnLoad(&ix, vectors_file)) {
+    printf("ERROR: cannot read vectors from %s\n", vectors_file);
+    return 1;
+  }
+  printf("%lld ngrams of %lld dimensions loaded in %.2f s\n", ix.rows, ix.dim, Now() - t);
+  if (ix.rows == 0) return 0;
+  t = Now();
+  if (read_index_file[0] != 0) {
+    if (!KnnLoadIvf(&ix, read_index_file)) {
+      printf("ERROR: %s is not a list file of %s\n", read_index_file, vectors_file);
+      return 1;
+    }
+    printf("%lld lists read in %.2f s\n", ix.nlist, Now() - t);
+  } else if (nlist > 0) {
+    KnnBuildIvf(&ix, nlist, iters, threads);
+    printf("%lld lists built in %.2f s\n", ix.nlist, Now() - t);
+  }
+  if (save_index_file[0] != 0 && !KnnSaveIvf(&ix, save_index_file)) {
+    printf("ERROR: cannot save the lists to %s\n", save_index_file);
+    return 1;
+  }
+  if (bench > 0) Bench();
+  else Interactive();
+  KnnFree(&ix);
+  return 0;
+}
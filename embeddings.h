@@ -0,0 +1,167 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// The binary vector file written with -binary 2, and a reader that maps it.
+//
+// The file is a header, the string table of the ngrams (an offset per ngram and one more for the
+// end, then the ngrams as space separated words, each ended by 0), the scale of every row for
+// int8 vectors, and the vectors, one row after the other from a page aligned offset. All numbers
+// are little endian. A reader maps the file and uses the vectors in place, so loading takes no
+// time and processes mapping the same file share its pages.
+//
+// A model trained with -buckets has header.buckets more rows after the named ones, without names:
+// an ngram of known words that is not in the file has the row of its bucket, see EmbeddingBucket
+
+#ifndef EMBEDDINGS_H
+#define EMBEDDINGS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EMBEDDINGS_VERSION 1
+#define EMBEDDINGS_ALIGN 4096
+#define NGRAM_HASH_MUL 0x9E3779B97F4A7C15ULL
+
+enum {EMBEDDINGS_F32, EMBEDDINGS_F16, EMBEDDINGS_I8};
+
+struct embeddings_header {
+  char magic[8];                       // "NG2VEMB" and 0
+  int version, type, ngrams, buckets;  // buckets: rows after the named ones, see EmbeddingBucket
+  long long rows, dim, row_size;       // row_size: bytes from one row to the next
+  long long index_offset, strings_offset, strings_size, scales_offset, vectors_offset, file_size;
+};
+
+struct embeddings {
+  struct embeddings_header *header;
+  long long rows, dim, *index;
+  char *strings;
+  float *scales;
+  unsigned char *vectors;
+  long long map_size;
+};
+
+// IEEE half precision, rounded to nearest even; the hardware conversions are not needed for the
+// few conversions a save or a lookup makes
+static inline unsigned short FloatToHalf(float f) {
+  unsigned int x, sign, mant;
+  int exp;
+  memcpy(&x, &f, 4);
+  sign = (x >> 16) & 0x8000;
+  exp = (int)((x >> 23) & 0xff) - 127 + 15;
+  mant = x & 0x7fffff;
+  if (((x >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mant ? 0x200 : 0);
+  if (exp >= 31) return sign | 0x7c00;
+  if (exp <= 0) {
+    if (exp < -10) return sign;
+    mant |= 0x800000;
+    x = mant >> (14 - exp);
+    if ((mant >> (13 - exp)) & 1 && (mant & ((1u << (13 - exp)) - 1) || x & 1)) x++;
+    return sign | x;
+  }
+  x = sign | (exp << 10) | (mant >> 13);
+  // A carry out of the mantissa correctly moves on to the next exponent
+  if (mant & 0x1000 && (mant & 0xfff || x & 1)) x++;
+  return x;
+}
+
+static inline float HalfToFloat(unsigned short h) {
+  unsigned int sign = (h & 0x8000) << 16, exp = (h >> 10) & 0x1f, mant = h & 0x3ff, x;
+  float f;
+  if (exp == 0x1f) x = sign | 0x7f800000 | (mant << 13);
+  else if (exp) x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+  else if (mant == 0) x = sign;
+  else {
+    exp = 127 - 15 + 1;
+    while (!(mant & 0x400)) {mant <<= 1; exp--;}
+    x = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+  memcpy(&f, &x, 4);
+  return f;
+}
+
+// Returns hash value of an ngram from the ids of its words, not yet reduced to a table size.
+// The words are read from the last one backwards, so that at one position the hash of each
+// order extends the hash of the order below it
+static inline unsigned long long HashNgram(int *wids, int order) {
+  unsigned long long hash = 0;
+  int i;
+  for (i = order - 1; i >= 0; i--) hash = hash * NGRAM_HASH_MUL + wids[i] + 1;
+  return hash;
+}
+
+// Reduces a hash to a slot of a table of the given size. The final mix spreads the few bits
+// that differ between short words or small word ids over the whole table
+static inline unsigned long long HashSlot(unsigned long long hash, long long size) {
+  hash ^= hash >> 33;
+  hash *= 0xFF51AFD7ED558CCDULL;
+  hash ^= hash >> 33;
+  return hash % size;
+}
+
+// Maps a vector file; returns 0 if it cannot be read or is not one
+static inline int OpenEmbeddings(struct embeddings *e, const char *file) {
+  struct stat st;
+  struct embeddings_header *h;
+  void *map;
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) return 0;
+  if (fstat(fd, &st) || st.st_size < (long long)sizeof(struct embeddings_header)) {close(fd); return 0;}
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return 0;
+  h = (struct embeddings_header *)map;
+  if (memcmp(h->magic, "NG2VEMB", 8) || h->version != EMBEDDINGS_VERSION || h->file_size != st.st_size) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+  e->header = h;
+  e->rows = h->rows;
+  e->dim = h->dim;
+  e->index = (long long *)((char *)map + h->index_offset);
+  e->strings = (char *)map + h->strings_offset;
+  e->scales = h->type == EMBEDDINGS_I8 ? (float *)((char *)map + h->scales_offset) : NULL;
+  e->vectors = (unsigned char *)map + h->vectors_offset;
+  e->map_size = st.st_size;
+  return 1;
+}
+
+static inline void CloseEmbeddings(struct embeddings *e) {
+  munmap(e->header, e->map_size);
+}
+
+static inline const char *EmbeddingName(struct embeddings *e, long long row) {
+  return e->strings + e->index[row];
+}
+
+// Returns the row of the bucket of an ngram given the ids of its words, which are their rows
+// (words come first), or -1 if the file has no buckets
+static inline long long EmbeddingBucket(struct embeddings *e, int *wids, int order) {
+  if (e->header->buckets <= 0) return -1;
+  return e->rows + HashSlot(HashNgram(wids, order), e->header->buckets);
+}
+
+// Copies a row into out as floats, whatever the type of the file
+static inline void EmbeddingRow(struct embeddings *e, long long row, float *out) {
+  long long i;
+  unsigned char *v = e->vectors + row * e->header->row_size;
+  if (e->header->type == EMBEDDINGS_F32) memcpy(out, v, e->dim * sizeof(float));
+  else if (e->header->type == EMBEDDINGS_F16) for (i = 0; i < e->dim; i++) out[i] = HalfToFloat(((unsigned short *)v)[i]);
+  else for (i = 0; i < e->dim; i++) out[i] = ((signed char *)v)[i] * e->scales[row];
+}
+
+#endif
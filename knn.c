@@ -0,0 +1,744 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "embeddings.h"
+#include "knn.h"
+
+#define KNN_VERSION 1
+#define QUERY_BATCH 64                 // Queries scanned together by KnnSearch
+#define ROW_BLOCK 256                  // Rows scanned by all queries of a batch while they are in cache
+
+struct knn_file_header {
+  char magic[8];                       // "NG2VIVF" and 0
+  int version, reserved;
+  long long rows, dim, nlist;
+};
+
+// The k best (score, id) pairs seen so far, as a min-heap on the score
+struct knn_heap {
+  float *scores;
+  long long *ids;
+  int size, k;
+};
+
+// Scores(x, rows, q, nq, n, out) sets out[r * nq + j] to the dot of row r of x and query j, for
+// nq <= 4 queries; rows and queries are n floats, n a multiple of 16. The vector kernels work on
+// tiles of rows and queries and reduce all the sums of a tile together
+void (*Scores)(const float *x, long long rows, const float *q, int nq, long long n, float *out);
+const char *kernel = NULL;
+
+float DotScalar(const float *x, const float *y, long long n) {
+  long long c;
+  float f = 0;
+  for (c = 0; c < n; c++) f += x[c] * y[c];
+  return f;
+}
+
+void ScoresScalar(const float *x, long long rows, const float *q, int nq, long long n, float *out) {
+  long long r;
+  int j;
+  for (r = 0; r < rows; r++) for (j = 0; j < nq; j++) out[r * nq + j] = DotScalar(x + r * n, q + j * n, n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Lane i of the result is the sum of the lanes of s[i]
+__attribute__((target("avx2,fma"))) static __m256 Reduce8Avx2(__m256 *s) {
+  __m256 a[4], b[2];
+  int i;
+  for (i = 0; i < 4; i++) a[i] = _mm256_add_ps(_mm256_unpacklo_ps(s[2 * i], s[2 * i + 1]), _mm256_unpackhi_ps(s[2 * i], s[2 * i + 1]));
+  for (i = 0; i < 2; i++) {
+    b[i] = _mm256_add_ps(_mm256_castpd_ps(_mm256_unpacklo_pd(_mm256_castps_pd(a[2 * i]), _mm256_castps_pd(a[2 * i + 1]))),
+                         _mm256_castpd_ps(_mm256_unpackhi_pd(_mm256_castps_pd(a[2 * i]), _mm256_castps_pd(a[2 * i + 1]))));
+  }
+  return _mm256_add_ps(_mm256_permute2f128_ps(b[0], b[1], 0x20), _mm256_permute2f128_ps(b[0], b[1], 0x31));
+}
+
+__attribute__((target("avx2,fma"))) void ScoresAvx2(const float *x, long long rows, const float *q, int nq, long long n, float *out) {
+  __m256 s[8], v0, v1, w;
+  float t[8];
+  long long r, c;
+  int i, j;
+  if (nq == 4) {
+    // Tiles of 2 rows by 4 queries
+    for (r = 0; r + 2 <= rows; r += 2) {
+      for (i = 0; i < 8; i++) s[i] = _mm256_setzero_ps();
+      for (c = 0; c < n; c += 8) {
+        v0 = _mm256_load_ps(x + r * n + c);
+        v1 = _mm256_load_ps(x + (r + 1) * n + c);
+        for (j = 0; j < 4; j++) {
+          w = _mm256_loadu_ps(q + j * n + c);
+          s[j] = _mm256_fmadd_ps(v0, w, s[j]);
+          s[4 + j] = _mm256_fmadd_ps(v1, w, s[4 + j]);
+        }
+      }
+      _mm256_storeu_ps(out + r * 4, Reduce8Avx2(s));
+    }
+    if (r < rows) ScoresScalar(x + r * n, rows - r, q, nq, n, out + r * nq);
+    return;
+  }
+  // Tiles of 8 rows by 1 query
+  for (j = 0; j < nq; j++) {
+    for (r = 0; r + 8 <= rows; r += 8) {
+      for (i = 0; i < 8; i++) s[i] = _mm256_setzero_ps();
+      for (c = 0; c < n; c += 8) {
+        w = _mm256_loadu_ps(q + j * n + c);
+        for (i = 0; i < 8; i++) s[i] = _mm256_fmadd_ps(_mm256_load_ps(x + (r + i) * n + c), w, s[i]);
+      }
+      _mm256_storeu_ps(t, Reduce8Avx2(s));
+      for (i = 0; i < 8; i++) out[(r + i) * nq + j] = t[i];
+    }
+    for (; r < rows; r++) out[r * nq + j] = DotScalar(x + r * n, q + j * n, n);
+  }
+}
+
+// Lane i of the result is the sum of the lanes of s[i]
+__attribute__((target("avx512f"))) static __m512 Reduce16Avx512(__m512 *s) {
+  __m512 a[8], b[4], ab, cd;
+  int i;
+  for (i = 0; i < 8; i++) a[i] = _mm512_add_ps(_mm512_unpacklo_ps(s[2 * i], s[2 * i + 1]), _mm512_unpackhi_ps(s[2 * i], s[2 * i + 1]));
+  for (i = 0; i < 4; i++) {
+    b[i] = _mm512_add_ps(_mm512_castpd_ps(_mm512_unpacklo_pd(_mm512_castps_pd(a[2 * i]), _mm512_castps_pd(a[2 * i + 1]))),
+                         _mm512_castpd_ps(_mm512_unpackhi_pd(_mm512_castps_pd(a[2 * i]), _mm512_castps_pd(a[2 * i + 1]))));
+  }
+  // Each 128 bit lane of b[i] now holds a part of the sums of s[4 * i] to s[4 * i + 3]
+  ab = _mm512_add_ps(_mm512_shuffle_f32x4(b[0], b[1], _MM_SHUFFLE(2, 0, 2, 0)), _mm512_shuffle_f32x4(b[0], b[1], _MM_SHUFFLE(3, 1, 3, 1)));
+  cd = _mm512_add_ps(_mm512_shuffle_f32x4(b[2], b[3], _MM_SHUFFLE(2, 0, 2, 0)), _mm512_shuffle_f32x4(b[2], b[3], _MM_SHUFFLE(3, 1, 3, 1)));
+  return _mm512_add_ps(_mm512_shuffle_f32x4(ab, cd, _MM_SHUFFLE(2, 0, 2, 0)), _mm512_shuffle_f32x4(ab, cd, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+__attribute__((target("avx512f"))) void ScoresAvx512(const float *x, long long rows, const float *q, int nq, long long n, float *out) {
+  __m512 s[16], v[4], w;
+  float t[16];
+  long long r, c;
+  int i, j;
+  if (nq == 4) {
+    // Tiles of 4 rows by 4 queries
+    for (r = 0; r + 4 <= rows; r += 4) {
+      for (i = 0; i < 16; i++) s[i] = _mm512_setzero_ps();
+      for (c = 0; c < n; c += 16) {
+        for (i = 0; i < 4; i++) v[i] = _mm512_load_ps(x + (r + i) * n + c);
+        for (j = 0; j < 4; j++) {
+          w = _mm512_loadu_ps(q + j * n + c);
+          for (i = 0; i < 4; i++) s[i * 4 + j] = _mm512_fmadd_ps(v[i], w, s[i * 4 + j]);
+        }
+      }
+      _mm512_storeu_ps(out + r * 4, Reduce16Avx512(s));
+    }
+    if (r < rows) ScoresScalar(x + r * n, rows - r, q, nq, n, out + r * nq);
+    return;
+  }
+  // Tiles of 16 rows by 1 query
+  for (j = 0; j < nq; j++) {
+    for (r = 0; r + 16 <= rows; r += 16) {
+      for (i = 0; i < 16; i++) s[i] = _mm512_setzero_ps();
+      for (c = 0; c < n; c += 16) {
+        w = _mm512_loadu_ps(q + j * n + c);
+        for (i = 0; i < 16; i++) s[i] = _mm512_fmadd_ps(_mm512_load_ps(x + (r + i) * n + c), w, s[i]);
+      }
+      _mm512_storeu_ps(t, Reduce16Avx512(s));
+      for (i = 0; i < 16; i++) out[(r + i) * nq + j] = t[i];
+    }
+    for (; r < rows; r++) out[r * nq + j] = DotScalar(x + r * n, q + j * n, n);
+  }
+}
+#endif
+
+// Picks the best kernels the CPU supports, once
+void InitKernels() {
+  if (kernel != NULL) return;
+  Scores = ScoresScalar;
+  kernel = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    Scores = ScoresAvx512;
+    kernel = "avx512";
+  } else if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    Scores = ScoresAvx2;
+    kernel = "avx2";
+  }
+#endif
+}
+
+const char *KnnKernel() {
+  InitKernels();
+  return kernel;
+}
+
+void *AlignedAlloc(long long size) {
+  void *p = NULL;
+  if (posix_memalign(&p, 64, size ? size : 64)) return NULL;
+  return p;
+}
+
+unsigned long long HashName(const char *s) {
+  unsigned long long h = 14695981039346656037ULL;
+  for (; *s; s++) h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+  return h;
+}
+
+// Scales a row to unit length, unless it is all zeros
+void Normalize(float *v, long long dim) {
+  long long c;
+  double len = 0;
+  for (c = 0; c < dim; c++) len += v[c] * v[c];
+  if (len == 0) return;
+  len = sqrt(len);
+  for (c = 0; c < dim; c++) v[c] /= len;
+}
+
+// Allocates the rows and the names of an index
+int AllocIndex(struct knn_index *ix, long long rows, long long dim, long long strings_size) {
+  memset(ix, 0, sizeof(struct knn_index));
+  ix->rows = rows;
+  ix->dim = dim;
+  ix->stride = (dim + 15) / 16 * 16;
+  for (ix->hash_size = 1024; ix->hash_size < rows * 2; ix->hash_size *= 2);
+  ix->vectors = (float *)AlignedAlloc(rows * ix->stride * sizeof(float));
+  ix->names = (long long *)malloc((rows + 1) * sizeof(long long));
+  ix->strings = (char *)malloc(strings_size);
+  ix->hash = (long long *)malloc(ix->hash_size * sizeof(long long));
+  if (ix->vectors == NULL || ix->names == NULL || ix->strings == NULL || ix->hash == NULL) return 0;
+  memset(ix->vectors, 0, rows * ix->stride * sizeof(float));
+  return 1;
+}
+
+// Fills the name hash once the names are read
+void HashNames(struct knn_index *ix) {
+  long long a, h;
+  for (a = 0; a < ix->hash_size; a++) ix->hash[a] = -1;
+  for (a = 0; a < ix->rows; a++) {
+    h = HashName(ix->strings + ix->names[a]) & (ix->hash_size - 1);
+    while (ix->hash[h] != -1) h = (h + 1) & (ix->hash_size - 1);
+    ix->hash[h] = a;
+  }
+}
+
+// Loads a file written with -binary 2
+int LoadBinary(struct knn_index *ix, struct embeddings *e) {
+  long long a;
+  if (!AllocIndex(ix, e->rows, e->dim, e->header->strings_size)) return 0;
+  memcpy(ix->names, e->index, (e->rows + 1) * sizeof(long long));
+  memcpy(ix->strings, e->strings, e->header->strings_size);
+  for (a = 0; a < ix->rows; a++) EmbeddingRow(e, a, ix->vectors + a * ix->stride);
+  if (e->header->buckets > 0) {
+    ix->buckets = e->header->buckets;
+    ix->ngrams = e->header->ngrams;
+    ix->bucket_vectors = (float *)AlignedAlloc(ix->buckets * ix->stride * sizeof(float));
+    if (ix->bucket_vectors == NULL) return 0;
+    memset(ix->bucket_vectors, 0, ix->buckets * ix->stride * sizeof(float));
+    for (a = 0; a < ix->buckets; a++) EmbeddingRow(e, ix->rows + a, ix->bucket_vectors + a * ix->stride);
+  }
+  return 1;
+}
+
+// Loads the text output: a line with the rows and the dimension, then a line per row with the
+// name and the numbers, separated by tabs
+int LoadText(struct knn_index *ix, FILE *fin) {
+  long long rows, dim, a, b, len, size = 1 << 20, max_size = 0;
+  char *line = NULL, *p, *tab;
+  size_t line_size = 0;
+  if (fscanf(fin, "%lld\t%lld\n", &rows, &dim) != 2 || rows < 0 || dim <= 0) return 0;
+  if (!AllocIndex(ix, rows, dim, size)) return 0;
+  max_size = size;
+  size = 0;
+  for (a = 0; a < rows; a++) {
+    if (getline(&line, &line_size, fin) <= 0 || (tab = strchr(line, '\t')) == NULL) {free(line); return 0;}
+    len = tab - line;
+    if (size + len + 1 > max_size) {
+      max_size = max_size * 2 + len + 1;
+      ix->strings = (char *)realloc(ix->strings, max_size);
+      if (ix->strings == NULL) {free(line); return 0;}
+    }
+    memcpy(ix->strings + size, line, len);
+    ix->strings[size + len] = 0;
+    ix->names[a] = size;
+    size += len + 1;
+    for (b = 0, p = tab; b < dim; b++) ix->vectors[a * ix->stride + b] = strtof(p, &p);
+  }
+  ix->names[rows] = size;
+  free(line);
+  return 1;
+}
+
+int KnnLoad(struct knn_index *ix, const char *file) {
+  struct embeddings e;
+  FILE *fin;
+  long long a;
+  int ok;
+  InitKernels();
+  if (OpenEmbeddings(&e, file)) {
+    ok = LoadBinary(ix, &e);
+    CloseEmbeddings(&e);
+  } else {
+    fin = fopen(file, "rb");
+    if (fin == NULL) return 0;
+    ok = LoadText(ix, fin);
+    fclose(fin);
+  }
+  if (!ok) {
+    KnnFree(ix);
+    return 0;
+  }
+  for (a = 0; a < ix->rows; a++) Normalize(ix->vectors + a * ix->stride, ix->dim);
+  for (a = 0; a < ix->buckets; a++) Normalize(ix->bucket_vectors + a * ix->stride, ix->dim);
+  HashNames(ix);
+  return 1;
+}
+
+void KnnFree(struct knn_index *ix) {
+  free(ix->vectors);
+  free(ix->names);
+  free(ix->strings);
+  free(ix->hash);
+  free(ix->list_start);
+  free(ix->row_ids);
+  free(ix->positions);
+  free(ix->centroids);
+  free(ix->bucket_vectors);
+  memset(ix, 0, sizeof(struct knn_index));
+}
+
+long long KnnFind(struct knn_index *ix, const char *name) {
+  long long h = HashName(name) & (ix->hash_size - 1);
+  while (ix->hash[h] != -1) {
+    if (!strcmp(ix->strings + ix->names[ix->hash[h]], name)) return ix->hash[h];
+    h = (h + 1) & (ix->hash_size - 1);
+  }
+  return -1;
+}
+
+// The words of the name are rows without spaces, and the row of a word is its id in the trainer
+const float *KnnBucket(struct knn_index *ix, const char *name) {
+  char word[1024];
+  int wids[64], order = 0;
+  long long a, len;
+  if (ix->buckets <= 0) return NULL;
+  while (*name) {
+    len = strcspn(name, " ");
+    if (len == 0 || len >= (long long)sizeof(word) || order == ix->ngrams || order == 64) return NULL;
+    memcpy(word, name, len);
+    word[len] = 0;
+    if ((a = KnnFind(ix, word)) < 0) return NULL;
+    wids[order++] = a;
+    name += len;
+    if (*name == ' ') name++;
+  }
+  if (order < 2) return NULL;
+  return ix->bucket_vectors + HashSlot(HashNgram(wids, order), ix->buckets) * ix->stride;
+}
+
+const char *KnnName(struct knn_index *ix, long long row) {
+  return ix->strings + ix->names[row];
+}
+
+const float *KnnVector(struct knn_index *ix, long long row) {
+  return ix->vectors + (ix->positions ? ix->positions[row] : row) * ix->stride;
+}
+
+void HeapPush(struct knn_heap *h, float score, long long id) {
+  int i, c;
+  if (h->size == h->k) {
+    if (score <= h->scores[0]) return;
+    // Replace the worst and sift it down
+    for (i = 0; (c = 2 * i + 1) < h->size; i = c) {
+      if (c + 1 < h->size && h->scores[c + 1] < h->scores[c]) c++;
+      if (h->scores[c] >= score) break;
+      h->scores[i] = h->scores[c];
+      h->ids[i] = h->ids[c];
+    }
+  } else {
+    for (i = h->size++; i > 0 && h->scores[(i - 1) / 2] > score; i = (i - 1) / 2) {
+      h->scores[i] = h->scores[(i - 1) / 2];
+      h->ids[i] = h->ids[(i - 1) / 2];
+    }
+  }
+  h->scores[i] = score;
+  h->ids[i] = id;
+}
+
+// Writes the heap to ids and scores best first, padding with -1, and empties it
+void HeapPop(struct knn_heap *h, long long *ids, float *scores) {
+  int i, j;
+  for (i = 0; i < h->k; i++) {
+    ids[i] = -1;
+    scores[i] = -1;
+  }
+  // An insertion sort, as k is small
+  for (i = 0; i < h->size; i++) {
+    for (j = i; j > 0 && scores[j - 1] < h->scores[i]; j--) {
+      scores[j] = scores[j - 1];
+      ids[j] = ids[j - 1];
+    }
+    scores[j] = h->scores[i];
+    ids[j] = h->ids[i];
+  }
+  h->size = 0;
+}
+
+struct knn_heap *NewHeaps(long long n, int k) {
+  long long a;
+  struct knn_heap *h = (struct knn_heap *)malloc(n * sizeof(struct knn_heap));
+  float *scores = (float *)malloc(n * k * sizeof(float));
+  long long *ids = (long long *)malloc(n * k * sizeof(long long));
+  if (h == NULL || scores == NULL || ids == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < n; a++) {
+    h[a].scores = scores + a * k;
+    h[a].ids = ids + a * k;
+    h[a].size = 0;
+    h[a].k = k;
+  }
+  return h;
+}
+
+void FreeHeaps(struct knn_heap *h) {
+  free(h[0].scores);
+  free(h[0].ids);
+  free(h);
+}
+
+// Scores the positions [begin, end) of vectors against nq queries, ROW_BLOCK rows at a time so
+// that a block stays in cache while every query goes over it
+void ScanRows(struct knn_index *ix, long long begin, long long end, const float *queries, long long nq, struct knn_heap *heaps) {
+  long long block, rows, p, q, n = ix->stride;
+  float scores[ROW_BLOCK * 4], s;
+  int j, m;
+  struct knn_heap *h;
+  for (block = begin; block < end; block += rows) {
+    rows = end - block < ROW_BLOCK ? end - block : ROW_BLOCK;
+    for (q = 0; q < nq; q += m) {
+      m = nq - q < 4 ? nq - q : 4;
+      Scores(ix->vectors + block * n, rows, queries + q * n, m, n, scores);
+      for (p = 0; p < rows; p++) for (j = 0; j < m; j++) {
+        s = scores[p * m + j];
+        h = &heaps[q + j];
+        if (h->size < h->k || s > h->scores[0]) HeapPush(h, s, ix->row_ids ? ix->row_ids[block + p] : block + p);
+      }
+    }
+  }
+}
+
+struct search_job {
+  struct knn_index *ix;
+  const float *queries;
+  long long nq, *ids;
+  float *scores;
+  int k, nprobe, threads, id;
+  struct knn_heap *heaps;
+};
+
+// A thread of KnnSearch: scans its share of the rows for the current batch of queries
+void *SearchThread(void *arg) {
+  struct search_job *job = (struct search_job *)arg;
+  long long rows = job->ix->rows;
+  ScanRows(job->ix, rows * job->id / job->threads, rows * (job->id + 1) / job->threads, job->queries, job->nq, job->heaps + job->id * QUERY_BATCH);
+  return NULL;
+}
+
+// Runs f on threads jobs that differ only by their id
+void RunJobs(struct search_job *job, int threads, void *(*f)(void *)) {
+  pthread_t *pt = (pthread_t *)malloc(threads * sizeof(pthread_t));
+  struct search_job *jobs = (struct search_job *)malloc(threads * sizeof(struct search_job));
+  int t;
+  for (t = 0; t < threads; t++) {
+    jobs[t] = *job;
+    jobs[t].threads = threads;
+    jobs[t].id = t;
+  }
+  if (threads == 1) f(&jobs[0]);
+  else {
+    for (t = 0; t < threads; t++) pthread_create(&pt[t], NULL, f, &jobs[t]);
+    for (t = 0; t < threads; t++) pthread_join(pt[t], NULL);
+  }
+  free(jobs);
+  free(pt);
+}
+
+void KnnSearch(struct knn_index *ix, const float *queries, long long nq, int k, long long *ids, float *scores, int threads) {
+  struct search_job job;
+  struct knn_heap *heaps, *h;
+  long long q, b, batch, i;
+  int t;
+  InitKernels();
+  if (threads < 1) threads = 1;
+  if (threads > ix->rows / ROW_BLOCK) threads = ix->rows / ROW_BLOCK > 0 ? ix->rows / ROW_BLOCK : 1;
+  heaps = NewHeaps(threads * QUERY_BATCH, k);
+  for (q = 0; q < nq; q += QUERY_BATCH) {
+    batch = nq - q < QUERY_BATCH ? nq - q : QUERY_BATCH;
+    memset(&job, 0, sizeof(job));
+    job.ix = ix;
+    job.queries = queries + q * ix->stride;
+    job.nq = batch;
+    job.k = k;
+    job.heaps = heaps;
+    RunJobs(&job, threads, SearchThread);
+    // Merge the heaps of the other threads into those of the first
+    for (b = 0; b < batch; b++) {
+      for (t = 1; t < threads; t++) {
+        h = &heaps[t * QUERY_BATCH + b];
+        for (i = 0; i < h->size; i++) HeapPush(&heaps[b], h->scores[i], h->ids[i]);
+        h->size = 0;
+      }
+      HeapPop(&heaps[b], ids + (q + b) * k, scores + (q + b) * k);
+    }
+  }
+  FreeHeaps(heaps);
+}
+
+// Orders (list, query) probes by list
+int ProbeCompare(const void *a, const void *b) {
+  const long long *x = (const long long *)a, *y = (const long long *)b;
+  if (x[0] != y[0]) return x[0] < y[0] ? -1 : 1;
+  return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+// A thread of KnnSearchIvf: answers its share of the queries QUERY_BATCH at a time. The lists
+// probed by the queries of a batch are scanned once each, by all the queries that probe them
+void *SearchIvfThread(void *arg) {
+  struct search_job *job = (struct search_job *)arg;
+  struct knn_index *ix = job->ix;
+  long long n = ix->stride, q, first, last, batch, l, i, j, m, probe_count;
+  long long *probes = (long long *)malloc(QUERY_BATCH * job->nprobe * 2 * sizeof(long long));
+  long long *lists = (long long *)malloc(job->nprobe * sizeof(long long));
+  float *list_scores = (float *)malloc(job->nprobe * sizeof(float));
+  float *centroid_scores = (float *)malloc(ix->nlist * sizeof(float));
+  float *group = (float *)AlignedAlloc(QUERY_BATCH * n * sizeof(float));
+  struct knn_heap *best = NewHeaps(1, job->nprobe), *heaps = NewHeaps(QUERY_BATCH, job->k), group_heaps[QUERY_BATCH];
+  if (probes == NULL || lists == NULL || list_scores == NULL || centroid_scores == NULL || group == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  first = job->nq * job->id / job->threads;
+  last = job->nq * (job->id + 1) / job->threads;
+  for (q = first; q < last; q += batch) {
+    batch = last - q < QUERY_BATCH ? last - q : QUERY_BATCH;
+    probe_count = 0;
+    for (i = 0; i < batch; i++) {
+      Scores(ix->centroids, ix->nlist, job->queries + (q + i) * n, 1, n, centroid_scores);
+      for (l = 0; l < ix->nlist; l++) if (best->size < best->k || centroid_scores[l] > best->scores[0]) HeapPush(best, centroid_scores[l], l);
+      HeapPop(best, lists, list_scores);
+      for (j = 0; j < job->nprobe && lists[j] >= 0; j++) {
+        probes[probe_count * 2] = lists[j];
+        probes[probe_count * 2 + 1] = i;
+        probe_count++;
+      }
+    }
+    qsort(probes, probe_count, 2 * sizeof(long long), ProbeCompare);
+    for (i = 0; i < probe_count; i = j) {
+      l = probes[i * 2];
+      for (j = i; j < probe_count && probes[j * 2] == l; j++) {
+        m = probes[j * 2 + 1];
+        memcpy(group + (j - i) * n, job->queries + (q + m) * n, n * sizeof(float));
+        group_heaps[j - i] = heaps[m];
+      }
+      ScanRows(ix, ix->list_start[l], ix->list_start[l + 1], group, j - i, group_heaps);
+      for (m = i; m < j; m++) heaps[probes[m * 2 + 1]] = group_heaps[m - i];
+    }
+    for (i = 0; i < batch; i++) HeapPop(&heaps[i], job->ids + (q + i) * job->k, job->scores + (q + i) * job->k);
+  }
+  free(probes);
+  free(lists);
+  free(list_scores);
+  free(centroid_scores);
+  free(group);
+  FreeHeaps(best);
+  FreeHeaps(heaps);
+  return NULL;
+}
+
+void KnnSearchIvf(struct knn_index *ix, const float *queries, long long nq, int k, int nprobe, long long *ids, float *scores, int threads) {
+  struct search_job job;
+  if (ix->nlist == 0) {
+    KnnSearch(ix, queries, nq, k, ids, scores, threads);
+    return;
+  }
+  InitKernels();
+  if (threads < 1) threads = 1;
+  if (nprobe > ix->nlist) nprobe = ix->nlist;
+  memset(&job, 0, sizeof(job));
+  job.ix = ix;
+  job.queries = queries;
+  job.nq = nq;
+  job.ids = ids;
+  job.scores = scores;
+  job.k = k;
+  job.nprobe = nprobe;
+  RunJobs(&job, threads, SearchIvfThread);
+}
+
+// Makes the lists from the list of every row: orders the vectors by list and fills list_start,
+// row_ids and positions
+int SortLists(struct knn_index *ix, long long *list_of) {
+  long long a, p, *next = (long long *)calloc(ix->nlist + 1, sizeof(long long));
+  long long *row_ids = (long long *)malloc(ix->rows * sizeof(long long));
+  long long *positions = (long long *)malloc(ix->rows * sizeof(long long));
+  float *vectors = (float *)AlignedAlloc(ix->rows * ix->stride * sizeof(float));
+  if (next == NULL || row_ids == NULL || positions == NULL || vectors == NULL) return 0;
+  free(ix->list_start);
+  ix->list_start = (long long *)calloc(ix->nlist + 1, sizeof(long long));
+  if (ix->list_start == NULL) return 0;
+  for (p = 0; p < ix->rows; p++) ix->list_start[list_of[p] + 1]++;
+  for (a = 0; a < ix->nlist; a++) ix->list_start[a + 1] += ix->list_start[a];
+  memcpy(next, ix->list_start, (ix->nlist + 1) * sizeof(long long));
+  // list_of is by position; the row at a position moves to the next free place of its list
+  for (p = 0; p < ix->rows; p++) {
+    a = next[list_of[p]]++;
+    row_ids[a] = ix->row_ids ? ix->row_ids[p] : p;
+    positions[row_ids[a]] = a;
+    memcpy(vectors + a * ix->stride, ix->vectors + p * ix->stride, ix->stride * sizeof(float));
+  }
+  free(next);
+  free(ix->row_ids);
+  free(ix->positions);
+  free(ix->vectors);
+  ix->row_ids = row_ids;
+  ix->positions = positions;
+  ix->vectors = vectors;
+  return 1;
+}
+
+// Finds the closest centroid of each of n rows, with the centroids as a small index
+void AssignLists(struct knn_index *ix, const float *rows, long long n, long long *list_of, int threads) {
+  struct knn_index centroids;
+  float *scores = (float *)malloc(n * sizeof(float));
+  memset(&centroids, 0, sizeof(centroids));
+  centroids.rows = ix->nlist;
+  centroids.dim = ix->dim;
+  centroids.stride = ix->stride;
+  centroids.vectors = ix->centroids;
+  KnnSearch(&centroids, rows, n, 1, list_of, scores, threads);
+  free(scores);
+}
+
+void KnnBuildIvf(struct knn_index *ix, long long nlist, int iters, int threads) {
+  long long a, b, j, n, *sample_rows, *list_of, *sizes;
+  unsigned long long next_random = 1;
+  float *sample;
+  int it;
+  if (nlist < 1) nlist = 1;
+  if (nlist > ix->rows) nlist = ix->rows;
+  // k-means runs on a random sample of at most 64 rows per list
+  n = nlist * 64 < ix->rows ? nlist * 64 : ix->rows;
+  sample_rows = (long long *)malloc(ix->rows * sizeof(long long));
+  sample = (float *)AlignedAlloc(n * ix->stride * sizeof(float));
+  list_of = (long long *)malloc((ix->rows > n ? ix->rows : n) * sizeof(long long));
+  sizes = (long long *)malloc(nlist * sizeof(long long));
+  free(ix->centroids);
+  ix->centroids = (float *)AlignedAlloc(nlist * ix->stride * sizeof(float));
+  if (sample_rows == NULL || sample == NULL || list_of == NULL || sizes == NULL || ix->centroids == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < ix->rows; a++) sample_rows[a] = a;
+  for (a = 0; a < n; a++) {
+    next_random = next_random * 25214903917ULL + 11;
+    j = a + (long long)((next_random >> 16) % (ix->rows - a));
+    b = sample_rows[a];
+    sample_rows[a] = sample_rows[j];
+    sample_rows[j] = b;
+    memcpy(sample + a * ix->stride, ix->vectors + sample_rows[a] * ix->stride, ix->stride * sizeof(float));
+  }
+  ix->nlist = nlist;
+  memcpy(ix->centroids, sample, nlist * ix->stride * sizeof(float));
+  for (it = 0; it < iters; it++) {
+    AssignLists(ix, sample, n, list_of, threads);
+    memset(ix->centroids, 0, nlist * ix->stride * sizeof(float));
+    memset(sizes, 0, nlist * sizeof(long long));
+    for (a = 0; a < n; a++) {
+      sizes[list_of[a]]++;
+      for (b = 0; b < ix->dim; b++) ix->centroids[list_of[a] * ix->stride + b] += sample[a * ix->stride + b];
+    }
+    // An empty list restarts from a random row of the sample
+    for (j = 0; j < nlist; j++) {
+      if (sizes[j] == 0) {
+        next_random = next_random * 25214903917ULL + 11;
+        memcpy(ix->centroids + j * ix->stride, sample + (next_random >> 16) % n * ix->stride, ix->stride * sizeof(float));
+      }
+      Normalize(ix->centroids + j * ix->stride, ix->dim);
+    }
+  }
+  AssignLists(ix, ix->vectors, ix->rows, list_of, threads);
+  if (!SortLists(ix, list_of)) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  free(sample_rows);
+  free(sample);
+  free(list_of);
+  free(sizes);
+}
+
+// The list file holds a header, the centroids (dim floats each) and the rows of every list
+int KnnSaveIvf(struct knn_index *ix, const char *file) {
+  struct knn_file_header header;
+  long long l, *count;
+  FILE *fo;
+  if (ix->nlist == 0 || (fo = fopen(file, "wb")) == NULL) return 0;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "NG2VIVF", 8);
+  header.version = KNN_VERSION;
+  header.rows = ix->rows;
+  header.dim = ix->dim;
+  header.nlist = ix->nlist;
+  fwrite(&header, sizeof(header), 1, fo);
+  for (l = 0; l < ix->nlist; l++) fwrite(ix->centroids + l * ix->stride, sizeof(float), ix->dim, fo);
+  count = (long long *)malloc(ix->nlist * sizeof(long long));
+  for (l = 0; l < ix->nlist; l++) count[l] = ix->list_start[l + 1] - ix->list_start[l];
+  fwrite(count, sizeof(long long), ix->nlist, fo);
+  free(count);
+  fwrite(ix->row_ids, sizeof(long long), ix->rows, fo);
+  return !ferror(fo) & !fclose(fo);
+}
+
+int KnnLoadIvf(struct knn_index *ix, const char *file) {
+  struct knn_file_header header;
+  long long a, l, p, *count = NULL, *rows = NULL, *list_of = NULL;
+  int ok = 0;
+  FILE *fin = fopen(file, "rb");
+  if (fin == NULL) return 0;
+  if (fread(&header, sizeof(header), 1, fin) != 1 || memcmp(header.magic, "NG2VIVF", 8) || header.version != KNN_VERSION
+      || header.rows != ix->rows || header.dim != ix->dim || header.nlist < 1) goto done;
+  free(ix->centroids);
+  ix->centroids = (float *)AlignedAlloc(header.nlist * ix->stride * sizeof(float));
+  count = (long long *)malloc(header.nlist * sizeof(long long));
+  rows = (long long *)malloc(ix->rows * sizeof(long long));
+  list_of = (long long *)malloc(ix->rows * sizeof(long long));
+  if (ix->centroids == NULL || count == NULL || rows == NULL || list_of == NULL) goto done;
+  memset(ix->centroids, 0, header.nlist * ix->stride * sizeof(float));
+  for (l = 0; l < header.nlist; l++) if (fread(ix->centroids + l * ix->stride, sizeof(float), ix->dim, fin) != (size_t)ix->dim) goto done;
+  if (fread(count, sizeof(long long), header.nlist, fin) != (size_t)header.nlist) goto done;
+  if (fread(rows, sizeof(long long), ix->rows, fin) != (size_t)ix->rows) goto done;
+  // SortLists needs the list of the row at every current position
+  for (l = 0, p = 0; l < header.nlist; l++) for (a = 0; a < count[l]; a++, p++) {
+    if (p >= ix->rows || rows[p] < 0 || rows[p] >= ix->rows) goto done;
+    list_of[ix->positions ? ix->positions[rows[p]] : rows[p]] = l;
+  }
+  if (p != ix->rows) goto done;
+  ix->nlist = header.nlist;
+  ok = SortLists(ix, list_of);
+done:
+  fclose(fin);
+  free(count);
+  free(rows);
+  free(list_of);
+  return ok;
+}
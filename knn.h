@@ -0,0 +1,63 @@
+//  Copyright 2013 Google Inc. All Rights Reserved.
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+// Nearest neighbour queries over the vectors saved by ngram2vec, as text or with -binary 2.
+//
+// The rows are normalized once when loaded, so the cosine of two rows is their dot product.
+// KnnSearch scans all rows, a batch of queries at a time with SIMD kernels; KnnSearchIvf only
+// scans the rows of the lists (k-means clusters) whose centroids are closest to a query, after
+// KnnBuildIvf or KnnLoadIvf. Functions that can fail return 0 on failure and 1 on success
+
+#ifndef KNN_H
+#define KNN_H
+
+struct knn_index {
+  long long rows, dim, stride;         // stride: floats per row, dim rounded up to 16 and padded with 0
+  float *vectors;                      // Normalized rows, 64 byte aligned; in list order once there are lists
+  char *strings;                       // Names of the rows, each ended by 0
+  long long *names;                    // Offset of the name of each row in strings
+  long long *hash, hash_size;          // Rows by name
+  // The inverted lists: list l holds the positions [list_start[l], list_start[l + 1]) of vectors,
+  // the row at position p is row_ids[p] and row r is at positions[r]. Without lists, position and
+  // row are the same
+  long long nlist, *list_start, *row_ids, *positions;
+  float *centroids;
+  long long buckets;                   // Rows of the ngrams not in the file, from -buckets; not searched
+  float *bucket_vectors;
+  int ngrams;                          // Longest ngrams trained, which the buckets hold
+};
+
+int KnnLoad(struct knn_index *ix, const char *file);
+void KnnFree(struct knn_index *ix);
+long long KnnFind(struct knn_index *ix, const char *name);
+const char *KnnName(struct knn_index *ix, long long row);
+const float *KnnVector(struct knn_index *ix, long long row);
+// Returns the normalized vector of the bucket of an ngram of known words that is not a row, or
+// NULL if a word is unknown or the file has no buckets
+const float *KnnBucket(struct knn_index *ix, const char *name);
+const char *KnnKernel();
+
+// Finds the k rows closest to each of the nq queries (stride floats each, normalized), using
+// threads threads. ids and scores get k entries per query, best first; missing entries are -1
+void KnnSearch(struct knn_index *ix, const float *queries, long long nq, int k, long long *ids, float *scores, int threads);
+
+// Clusters the rows into nlist lists with iters rounds of spherical k-means
+void KnnBuildIvf(struct knn_index *ix, long long nlist, int iters, int threads);
+int KnnSaveIvf(struct knn_index *ix, const char *file);
+int KnnLoadIvf(struct knn_index *ix, const char *file);
+
+// As KnnSearch, but only scans the nprobe lists with the closest centroids
+void KnnSearchIvf(struct knn_index *ix, const float *queries, long long nq, int k, int nprobe, long long *ids, float *scores, int threads);
+
+#endif
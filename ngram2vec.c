@@ -12,63 +12,214 @@
 //  See the License for the specific language governing permissions and
 //  limitations under the License.
 
+#define _GNU_SOURCE                    // For pthread_setaffinity_np
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <malloc.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "embeddings.h"
 
 #define MAX_STRING 30
+#define MAX_PATH 1024                  // Bytes of a file name given as an option, with its ending 0
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
 #define MAX_SENTENCE_LENGTH 1000
 #define MAX_CODE_LENGTH 40
 #define MAX_NGRAM 10
+#define CACHE_EOS -2                   // Marks the end of a sentence in the corpus cache
+#define CACHE_VERSION 2
+#define CHECKPOINT_VERSION 3
+#define VOCAB_VERSION 2
+#define STREAM_BLOCK (1 << 16)         // Positions per block of the stream
+#define STREAM_READ (1 << 20)          // Bytes read at a time
+#define EXPORT_BLOCK_ROWS 4096         // Lines of the text output formatted at a time by a thread
+#define TEXT_BLOCK (1 << 20)           // Bytes of text per block of the decompression pipeline
+#define TEXT_AHEAD 4                   // Blocks of a file that are decompressed ahead of their readers
 
-const int ngram_hash_size = 60000000;  // Maximum 60 * 0.7 = 42M words in the vocabulary
+long long count_hash_size = 60000000;  // Hash slots for counting ngrams of order >= 2, at most 70% used; see PlanCounting
 
 typedef float real;                    // Precision of float numbers
 
+// Strings packed one after another, each ending with 0; they are referred to by offset
+struct string_arena {
+  char *data;
+  long long size, max_size;
+};
+
+// Counts the words or the longer ngrams of one shard of the training file, or merges one
+// partition of the shard counts. Words are keyed by string, ngrams by the word ids in 'words'
+struct ngram_table {
+  struct ngram_info *infos;
+  int *words;                          // 'ngrams' word ids per entry, padded with -1
+  long long size, max_size;
+  struct string_arena strings;         // Holds the words of a word table
+  long long *part_start, *remap;       // See GroupByPartition and MergeWordsThread
+  int *part, *order, *hash, hash_size;
+  // Shard ngram tables keep at most 'capacity' ngrams of one order (SpaceSaving): once full, a new
+  // ngram replaces one with the minimum count m, starts at m + 1 and records m in 'err', an
+  // upper bound of its overcount. Entries with equal counts are linked in one bucket, and the
+  // buckets are linked in increasing count order from min_bucket
+  long long capacity, *err, *bucket_cn;
+  int *next, *prev, *bucket, *bucket_head, *bucket_next, *bucket_prev, min_bucket, free_bucket;
+};
+
+// Walks a mapped region of text, see ReadToken
+struct token_reader {
+  char *pos, *end;
+  char word[MAX_STRING];               // Holds tokens that had to be rewritten
+};
+
 struct ngram_info {
-  long long cn;
-  int *point;
-  char *word, *code, codelen;
+  long long cn, word;                  // 'word' is the offset of a word in its string arena
+  char codelen;                        // The Huffman code of word a is in vocab_codes[a] and its points in vocab_points
+};
+
+// The corpus cache starts with this header, followed by one record of 'ngrams' ids per position:
+// record[n] is the id of the (n+1)-gram ending at that position, or -1 if it is not in the vocabulary.
+// A record whose first id is CACHE_EOS ends a sentence.
+struct cache_header {
+  char magic[8];
+  int version, ngrams;
+  long long ngram_size, total_words, positions, fingerprint;
+};
+
+// A checkpoint starts with this header, followed by the vocabulary (counts, word offsets, word
+// ids and strings), syn0, syn1 and syn1neg as present, the chunk_done flags and the thread states
+struct checkpoint_header {
+  char magic[8];
+  int version, ngrams, hs, negative, num_threads, storage, storage_outputs;
+  long long layer1_size, ngram_size, vocab_size, strings_size, iter, chunk_count, buckets;
+};
+
+// With -vocab-binary 1 the vocabulary is saved as this header followed by, each padded to 64
+// bytes so that they map aligned to cache lines: the counts and word offsets (long long), ngram_words, vocab_hash, ngram_hash and its keys,
+// the code lengths, code bits and points of the Huffman tree (MAX_CODE_LENGTH per word) and the
+// strings. It is mapped as it is, so a later run needs no counting, sorting or hashing
+struct vocab_header {
+  char magic[8];
+  int version, ngrams;
+  long long vocab_size, ngram_size, strings_size, total_words, vocab_hash_size, ngram_hash_size, ngram_hash_used;
+};
+
+// Where a training thread is, published at every sentence start for the checkpoints
+struct thread_state {
+  unsigned long long next_random;
+  long long epoch, chunk, pos, words;    // words: how many the thread has trained in all
+};
+
+// With -hot-rows, a training thread's own copy of the rows [begin, end) of an output matrix, the
+// most used ones: it trains them without touching the shared rows, and adds what they learned
+// to the shared rows every -hot-flush words, see FlushHotRows. 'base' is the copy at the last flush
+struct hot_rows {
+  real *local, *base;
+  long long begin, end;
 };
 
-char train_file[MAX_STRING], output_file[MAX_STRING];
-char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
+char train_file[MAX_PATH], output_file[MAX_PATH], cache_file[MAX_PATH];
+char save_vocab_file[MAX_PATH], read_vocab_file[MAX_PATH], quantize[MAX_STRING];
 struct ngram_info *ngram_infos;
+int *ngram_words;                      // 'ngrams' word ids per vocabulary entry, padded with -1
 int ngrams;
-int binary = 0, debug_mode = 2, window = 5, num_threads = 12, min_reduce = 1;
-int *ngram_hash;
-long long ngram_max_size = 1000, vocab_size = 0, layer1_size = 100, ngram_size;
-long long total_words = 0, word_count_actual = 0, iter = 5, file_size = 0;
+int binary = 0, debug_mode = 2, window = 5, num_threads = 12, precision = 6;
+long long max_ngrams = 0;              // Words and ngrams of each higher order kept in the vocabulary; 0 = all counted
+long long buckets = 0;                 // Shared rows of the ngrams not in the vocabulary, after its rows; 0 = none
+long long max_memory = 0;              // Bytes that the counting tables and the model are planned to fit in; 0 = no limit
+int vocab_binary = 0, tree_built = 0;  // Save the vocabulary as a vocab_header file; the Huffman codes are up to date
+struct string_arena vocab_strings;
+unsigned long long *vocab_codes;       // Per word, bit d is the branch taken at depth d of its Huffman path
+int *vocab_points;                     // Per word, MAX_CODE_LENGTH inner nodes from the root; aligned to cache lines
+int *ngram_hash, *vocab_hash;          // Ngrams of order >= 2 by word ids, words by string
+unsigned long long *ngram_hash_keys;   // HashNgram of the ngram in each slot of ngram_hash
+long long ngram_max_size = 1000, vocab_size = 0, layer1_size = 100, ngram_size, vocab_hash_size;
+long long ngram_hash_size, ngram_hash_used;
+long long total_words = 0, word_count_actual = 0, iter = 5;
+int *corpus;                           // Mmap'ed records of the corpus cache
+long long corpus_positions = 0, corpus_map_size = 0;
+void *corpus_map;
+struct ngram_table *shard_words, *shard_grams, *merged_words, *merged_grams;   // Used by the vocabulary pass
+long long *word_offsets;
+char *train_text;
+long long train_text_size;
 real alpha = 0.025, starting_alpha, sample = 1e-3;
 real *syn0, *syn1, *syn1neg, *expTable;
-clock_t start;
+enum {STORAGE_F32, STORAGE_F16, STORAGE_BF16};
+int storage = STORAGE_F32, storage_outputs = 0;
+unsigned short *syn0_half, *syn1neg_half;    // syn0, and with -storage-outputs syn1neg, as -storage f16 or bf16
+int *row_order;                        // 0, 1, ..., negative: the rows of a block converted from syn1neg_half
+double start, finish;                  // When the threads started, and when the last one finished
+long long start_words;                 // word_count_actual when the threads started
+char kernel_name[MAX_STRING];
+int compute_sigmoid = 0, shared_negatives = 0, pin_threads = 0;
+long long *chunk_start, chunk_count;   // Sentence-aligned chunks of the corpus cache, see InitChunks
+unsigned long long *chunk_queues;      // Per epoch and thread, the chunks [lo, hi) left as hi << 32 | lo
+char *chunk_done;                      // Per epoch and chunk: 0 = to do, 1 = done, 2 = resumed by a thread
+char checkpoint_file[MAX_PATH];
+long long checkpoint_interval = 1800;
+int resume = 0, threads_done = 0;
+struct thread_state *thread_states;
+int stream = 0;                        // 1: train on -train as it is read, 2: also follow it as it grows
+long long stream_min_count = 5, stream_update = 1000000;
+long long stream_ngram_base;           // With -stream, words have the ids below it and ngrams the ids from it on
+int workers = 1, worker_id = 0;        // Processes that share the training, see RunWorkers, and which one this is
+long long sync_words = 20000;
+long long hot_rows = 0, hot_flush = 1000;
 
-int hs = 0, negative = 5;
-const int neg_table_size = 1e8;
-int *neg_table;
+// Parts of the memory plan of -max-memory, see PlanMemory
+enum {PLAN_WEIGHTS, PLAN_VOCAB, PLAN_SAMPLER, PLAN_THREADS, PLAN_PARTS};
+const char *plan_names[PLAN_PARTS] = {"weights", "vocabulary", "negative sampler", "threads"};
 
-void InitUnigramTable() {
-  int a, i;
-  double total_words_pow = 0;
-  double d1, power = 0.75;
-  neg_table = (int *)malloc(neg_table_size * sizeof(int));
-  for (a = 0; a < vocab_size; a++) total_words_pow += pow(ngram_infos[a].cn, power);
-  i = 0;
-  d1 = pow(ngram_infos[i].cn, power) / total_words_pow;
-  for (a = 0; a < neg_table_size; a++) {
-    neg_table[a] = i;
-    if (a / (double)neg_table_size > d1) {
-      i++;
-      d1 += pow(ngram_infos[i].cn, power) / total_words_pow;
-    }
-    if (i >= vocab_size) i = vocab_size - 1;
-  }
-}
+// Phases of a run, timed by the wall clock
+enum {PHASE_VOCAB, PHASE_SORT, PHASE_HUFFMAN, PHASE_ENCODE, PHASE_INIT, PHASE_TRAIN, PHASE_SAVE, PHASES};
+const char *phase_names[PHASES] = {"vocab", "sort", "huffman", "encode", "init", "train", "save"};
+double phase_time[PHASES];
+
+// Sections of the work timed in cycles, on a sample of the tokens and sentences, with -profile 1
+enum {CYCLES_TOKENIZE, CYCLES_LOOKUP, CYCLES_READ, CYCLES_GRADIENT, CYCLE_SECTIONS};
+const char *cycle_names[CYCLE_SECTIONS] = {"tokenize", "lookup", "read", "gradient"};
+#define PROFILE_SAMPLE 64              // One token or sentence in PROFILE_SAMPLE is timed
+
+// Counters of a training thread, on their own cache lines. misses are the words and ngrams of
+// the corpus that are not in the vocabulary; cycles are those of the sampled sentences
+struct thread_metrics {
+  long long words, pairs, negatives, misses, cycles[CYCLE_SECTIONS];
+} __attribute__((aligned(64)));
+struct thread_metrics *thread_metrics;
+long long encode_cycles[CYCLE_SECTIONS];
+char metrics_file[MAX_PATH];
+long long metrics_interval = 10;
+int profile = 0;
+
+int hs = 0, negative = 5;
+// Walker alias table of the negative sampler: slot a yields word a if a uniform 24-bit number
+// is below 'cut', and word 'alias' otherwise
+struct alias_slot {
+  unsigned int cut;
+  int alias;
+};
+// The table holds its size, so that -stream can replace it while the threads sample; a replaced
+// table waits in a list until no thread can still be drawing from it
+struct alias_table {
+  long long size, retired;             // The sampler epoch that replaced it
+  struct alias_table *next;
+  struct alias_slot slot[];
+};
+struct alias_table *alias_table;
+double *unigram_weights;               // Used while building alias_table
 
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
 void ReadWord(char *word, FILE *fin) {
@@ -93,129 +244,1033 @@ void ReadWord(char *word, FILE *fin) {
   word[a] = 0;
 }
 
-// Returns hash value of a word
-int GetWordHash(char *word) {
-  unsigned long long a, hash = 0;
-  for (a = 0; a < strlen(word); a++) hash = hash * 257 + word[a];
-  hash = hash % ngram_hash_size;
+// Returns the next token of the region as a view into it and stores its length in *len, or NULL at
+// the end of the region. Follows ReadWord: a newline is returned as </s>, carriage returns are
+// dropped and too long words are truncated; only tokens that need such rewriting are copied
+char *ReadToken(struct token_reader *tr, int *len) {
+  char *p = tr->pos, *end = tr->end, *s;
+  int a;
+  while (p < end && (*p == ' ' || *p == '\t' || *p == 13)) p++;
+  if (p == end) {
+    tr->pos = p;
+    return NULL;
+  }
+  if (*p == '\n') {
+    tr->pos = p + 1;
+    *len = 4;
+    return (char *)"</s>";
+  }
+  s = p;
+  while (p < end && (unsigned char)*p > ' ') p++;   // Fast skip over bytes that can never end a word
+  while (p < end && *p != ' ' && *p != '\t' && *p != '\n' && *p != 13) p++;
+  if (p < end && *p == 13) {
+    // Slow path: a carriage return inside the word is skipped as if it was not there
+    a = 0;
+    for (p = s; p < end && *p != ' ' && *p != '\t' && *p != '\n'; p++) if (*p != 13) {
+      tr->word[a] = *p;
+      if (a < MAX_STRING - 2) a++;
+    }
+    tr->pos = p;
+    *len = a;
+    return tr->word;
+  }
+  tr->pos = p;
+  *len = p - s;
+  if (*len > MAX_STRING - 2) *len = MAX_STRING - 2;   // Truncate too long words
+  return s;
+}
+
+// Maps a whole file read-only into memory; the size is stored in *size
+char *MapFile(char *file, long long *size) {
+  struct stat st;
+  char *text;
+  int fd = open(file, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  *size = st.st_size;
+  if (*size == 0) {
+    close(fd);
+    return NULL;
+  }
+  text = (char *)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (text == MAP_FAILED) {
+    printf("ERROR: cannot map %s\n", file);
+    exit(1);
+  }
+  madvise(text, *size, MADV_SEQUENTIAL);
+  return text;
+}
+
+// Training text that is compressed or in several files goes through a pipeline instead of being
+// mapped: decompress threads take the files in order and cut them into sentence-aligned blocks of
+// TEXT_BLOCK bytes, at most TEXT_AHEAD ahead per file. gzip and zstd files are decompressed by a
+// gzip -dc or zstd -dc child process each, so files are decompressed on as many cores as there
+// are decompress threads. The counting threads take blocks of any file, and the encoding takes
+// the files in order
+
+struct text_file {
+  char *name;
+  char *blocks[TEXT_AHEAD];
+  long long sizes[TEXT_AHEAD], first, count;   // A ring of the blocks ready
+  int done;
+};
+
+char train_list[MAX_PATH];
+struct text_file *text_files;
+int text_file_count, text_pipeline = 0, decompress_threads = 0, next_text_file;
+pthread_t *decompress_pt;
+pthread_mutex_t text_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t text_cond = PTHREAD_COND_INITIALIZER;
+
+// Returns 1 for a gzip file, 2 for a zstd file and 0 for anything else, from its first bytes
+int CompressedFile(char *file) {
+  unsigned char magic[4];
+  FILE *fin = fopen(file, "rb");
+  int n;
+  // A missing file is found missing where it is read, if it is
+  if (fin == NULL) return 0;
+  n = fread(magic, 1, 4, fin);
+  fclose(fin);
+  if (n >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) return 1;
+  if (n == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return 2;
+  return 0;
+}
+
+// Opens a training file for reading its text; a compressed one is read from the pipe of a child
+// process that decompresses it, whose pid is stored in *pid (0 for a plain file)
+int OpenText(char *file, pid_t *pid) {
+  int fd[2], type = CompressedFile(file);
+  *pid = 0;
+  if (type == 0) return open(file, O_RDONLY | O_CLOEXEC);
+  // Close-on-exec, so that a child another thread forks meanwhile does not hold this pipe open;
+  // dup2 clears the flag on the end the child writes to
+  if (pipe2(fd, O_CLOEXEC) != 0 || (*pid = fork()) < 0) {
+    printf("ERROR: cannot start decompressing %s\n", file);
+    exit(1);
+  }
+  if (*pid == 0) {
+    dup2(fd[1], 1);
+    close(fd[0]);
+    close(fd[1]);
+    if (type == 1) execlp("gzip", "gzip", "-dc", "--", file, (char *)NULL);
+    else execlp("zstd", "zstd", "-dcq", "--", file, (char *)NULL);
+    _exit(127);
+  }
+  close(fd[1]);
+  return fd[0];
+}
+
+// Closes a file opened by OpenText that was read to its end, and checks that its decompression succeeded
+void CloseText(int fd, pid_t pid, char *file) {
+  int status;
+  close(fd);
+  if (pid > 0 && (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)) {
+    printf("ERROR: decompressing %s failed; gzip or zstd must be installed\n", file);
+    exit(1);
+  }
+}
+
+// Lists the training files: those of -train-list, one per line, or -train. The pipeline is used
+// if there are several or one is compressed
+void InitTextFiles() {
+  char line[MAX_PATH + 2];   // A name, its \r\n and the ending 0
+  int len;
+  FILE *fin;
+  text_files = (struct text_file *)calloc(1, sizeof(struct text_file));
+  text_file_count = 0;
+  if (train_list[0] == 0) {
+    text_files[0].name = train_file;
+    text_file_count = 1;
+  } else {
+    fin = fopen(train_list, "rb");
+    if (fin == NULL) {
+      printf("ERROR: training file list %s not found\n", train_list);
+      exit(1);
+    }
+    while (fgets(line, sizeof(line), fin) != NULL) {
+      len = strlen(line);
+      if (len > 0 && line[len - 1] != '\n' && !feof(fin)) {
+        printf("ERROR: a file name in %s is longer than %d bytes\n", train_list, MAX_PATH - 1);
+        exit(1);
+      }
+      while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ')) line[--len] = 0;
+      if (len == 0) continue;
+      text_files = (struct text_file *)realloc(text_files, (text_file_count + 1) * sizeof(struct text_file));
+      if (text_files == NULL) {printf("Memory allocation failed\n"); exit(1);}
+      memset(&text_files[text_file_count], 0, sizeof(struct text_file));
+      text_files[text_file_count++].name = strdup(line);
+    }
+    fclose(fin);
+    if (text_file_count == 0) {
+      printf("ERROR: training file list %s is empty\n", train_list);
+      exit(1);
+    }
+  }
+  // Standard input, "-", can only be read by -stream
+  text_pipeline = text_file_count > 1 || (strcmp(text_files[0].name, "-") && CompressedFile(text_files[0].name));
+  if (decompress_threads == 0) decompress_threads = text_file_count < num_threads ? text_file_count : num_threads;
+}
+
+// Adds a block of text to the ring of its file, waiting for room
+void PushTextBlock(struct text_file *f, char *block, long long size) {
+  pthread_mutex_lock(&text_mutex);
+  while (f->count == TEXT_AHEAD) pthread_cond_wait(&text_cond, &text_mutex);
+  f->blocks[(f->first + f->count) % TEXT_AHEAD] = block;
+  f->sizes[(f->first + f->count) % TEXT_AHEAD] = size;
+  f->count++;
+  pthread_cond_broadcast(&text_cond);
+  pthread_mutex_unlock(&text_mutex);
+}
+
+// Reads the training files in turn and cuts them into blocks that end at a line end; a line
+// longer than a block is cut where the block is full. The last line of a file always ends
+void *DecompressThread(void *arg) {
+  struct text_file *f;
+  char *block, *next;
+  long long size, cut;
+  ssize_t got;
+  pid_t pid;
+  int fd, i;
+  while (1) {
+    pthread_mutex_lock(&text_mutex);
+    i = next_text_file++;
+    pthread_mutex_unlock(&text_mutex);
+    if (i >= text_file_count) break;
+    f = &text_files[i];
+    fd = OpenText(f->name, &pid);
+    if (fd < 0) {
+      printf("ERROR: training data file %s not found!\n", f->name);
+      exit(1);
+    }
+    block = (char *)malloc(TEXT_BLOCK + 1);
+    size = 0;
+    while (1) {
+      if (block == NULL) {printf("Memory allocation failed\n"); exit(1);}
+      got = read(fd, block + size, TEXT_BLOCK - size);
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0) {
+        printf("ERROR: reading %s failed\n", f->name);
+        exit(1);
+      }
+      size += got;
+      if (got == 0) break;
+      if (size < TEXT_BLOCK) continue;
+      for (cut = size; cut > 0 && block[cut - 1] != '\n'; cut--);
+      if (cut == 0) cut = size;
+      next = (char *)malloc(TEXT_BLOCK + 1);
+      if (next != NULL) memcpy(next, block + cut, size - cut);
+      PushTextBlock(f, block, cut);
+      block = next;
+      size -= cut;
+    }
+    CloseText(fd, pid, f->name);
+    if (size > 0 && block[size - 1] != '\n') block[size++] = '\n';
+    if (size > 0) PushTextBlock(f, block, size);
+    else free(block);
+    pthread_mutex_lock(&text_mutex);
+    f->done = 1;
+    pthread_cond_broadcast(&text_cond);
+    pthread_mutex_unlock(&text_mutex);
+  }
+  pthread_exit(NULL);
+}
+
+// Returns the next block of text of file i, or of any file if i < 0, and its size; NULL once
+// they are all read. The caller frees the block
+char *TakeTextBlock(int i, long long *size) {
+  char *block = NULL;
+  int a, done;
+  pthread_mutex_lock(&text_mutex);
+  while (1) {
+    done = 1;
+    for (a = i < 0 ? 0 : i; a < (i < 0 ? text_file_count : i + 1); a++) {
+      if (text_files[a].count > 0) {
+        block = text_files[a].blocks[text_files[a].first];
+        *size = text_files[a].sizes[text_files[a].first];
+        text_files[a].first = (text_files[a].first + 1) % TEXT_AHEAD;
+        text_files[a].count--;
+        break;
+      }
+      if (!text_files[a].done) done = 0;
+    }
+    if (block != NULL || done) break;
+    pthread_cond_wait(&text_cond, &text_mutex);
+  }
+  pthread_cond_broadcast(&text_cond);
+  pthread_mutex_unlock(&text_mutex);
+  return block;
+}
+
+// Starts reading the training files from the first, for one pass over them
+void StartTextPipeline() {
+  long long a;
+  for (a = 0; a < text_file_count; a++) {
+    text_files[a].first = text_files[a].count = 0;
+    text_files[a].done = 0;
+  }
+  next_text_file = 0;
+  decompress_pt = (pthread_t *)malloc(decompress_threads * sizeof(pthread_t));
+  for (a = 0; a < decompress_threads; a++) pthread_create(&decompress_pt[a], NULL, DecompressThread, NULL);
+}
+
+// Waits for the decompress threads once all blocks were taken
+void StopTextPipeline() {
+  long long a;
+  for (a = 0; a < decompress_threads; a++) pthread_join(decompress_pt[a], NULL);
+  free(decompress_pt);
+}
+
+// Returns hash value of a word, not yet reduced to a table size
+unsigned long long HashString(char *word, int len) {
+  unsigned long long hash = 0;
+  int a;
+  for (a = 0; a < len; a++) hash = hash * 257 + word[a];
   return hash;
 }
 
+// HashNgram and HashSlot are in embeddings.h, so that readers find the bucket of an ngram as
+// the trainer does
+
+// Seconds since some fixed point, by the wall clock
+double Now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// The time stamp counter, for the sampled cycle counts of -profile 1
+unsigned long long Cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+// Peak resident memory of the process in KB
+long long MaxRss() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+// Returns the order of an ngram from its padded word ids
+int NgramOrder(int *wids) {
+  int order = 1;
+  while (order < ngrams && wids[order] >= 0) order++;
+  return order;
+}
+
+// Returns 1 if the padded word ids of a stored ngram are the order words in wids
+int NgramEquals(int *stored, int *wids, int order) {
+  if (memcmp(stored, wids, order * sizeof(int))) return 0;
+  return order == ngrams || stored[order] == -1;
+}
+
+// Appends a word to an arena and returns its offset. The arena grows by doubling
+long long AddString(struct string_arena *s, char *word, int len) {
+  if (s->size + len + 1 > s->max_size) {
+    s->max_size = s->max_size * 2 + len + 1024;
+    s->data = (char *)realloc(s->data, s->max_size);
+    if (s->data == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  memcpy(s->data + s->size, word, len);
+  s->data[s->size + len] = 0;
+  s->size += len + 1;
+  return s->size - len - 1;
+}
+
+// Returns the string of a word of the vocabulary
+char *VocabWord(long long a) {
+  return vocab_strings.data + ngram_infos[a].word;
+}
+
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word) {
-  unsigned int hash = GetWordHash(word);
+int SearchVocab(char *word, int len) {
+  unsigned long long hash = HashSlot(HashString(word, len), vocab_hash_size);
+  char *w;
   while (1) {
-    if (ngram_hash[hash] == -1) return -1;
-    if (!strcmp(word, ngram_infos[ngram_hash[hash]].word)) return ngram_hash[hash];
-    hash = (hash + 1) % ngram_hash_size;
+    if (vocab_hash[hash] == -1) return -1;
+    w = VocabWord(vocab_hash[hash]);
+    if (!strncmp(word, w, len) && w[len] == 0) return vocab_hash[hash];
+    hash = (hash + 1) % vocab_hash_size;
   }
   return -1;
 }
 
-// Reads a word and returns its index in the vocabulary
-int ReadWordIndex(FILE *fin) {
-  char word[MAX_STRING];
-  ReadWord(word, fin);
-  if (feof(fin)) return -1;
-  return SearchVocab(word);
+// Returns position of an ngram of order >= 2 in the vocabulary, given its HashNgram;
+// if the ngram is not found, returns -1
+int SearchNgram(int *wids, int order, unsigned long long hash) {
+  long long slot = HashSlot(hash, ngram_hash_size);
+  while (1) {
+    if (ngram_hash[slot] == -1) return -1;
+    if (ngram_hash_keys[slot] == hash && NgramEquals(ngram_words + (long long)ngram_hash[slot] * ngrams, wids, order)) return ngram_hash[slot];
+    slot = (slot + 1) % ngram_hash_size;
+  }
+  return -1;
 }
 
-// Adds a word to the vocabulary
-int AddWordToVocab(char *word) {
-  unsigned int hash, length = strlen(word) + 1;
-  if (length > MAX_STRING*MAX_NGRAM + MAX_NGRAM) length = MAX_STRING*MAX_NGRAM + MAX_NGRAM;
-  ngram_infos[ngram_size].word = (char *)calloc(length, sizeof(char));
-  strcpy(ngram_infos[ngram_size].word, word);
-  ngram_infos[ngram_size].cn = 0;
-  ngram_size++;
-  // Reallocate memory if needed
+// Allocates an empty ngram hash with the given number of slots, or moves the ngrams to it.
+// The slots are found again from the cached keys, without reading the ngrams
+void ResizeNgramHash(long long size) {
+  int *old_hash = ngram_hash;
+  unsigned long long *old_keys = ngram_hash_keys;
+  long long a, slot, old_size = ngram_hash_size;
+  ngram_hash_size = size;
+  ngram_hash = (int *)malloc(ngram_hash_size * sizeof(int));
+  ngram_hash_keys = (unsigned long long *)malloc(ngram_hash_size * sizeof(unsigned long long));
+  if (ngram_hash == NULL || ngram_hash_keys == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < ngram_hash_size; a++) ngram_hash[a] = -1;
+  for (a = 0; a < old_size && old_hash != NULL; a++) if (old_hash[a] != -1) {
+    slot = HashSlot(old_keys[a], ngram_hash_size);
+    while (ngram_hash[slot] != -1) slot = (slot + 1) % ngram_hash_size;
+    ngram_hash[slot] = old_hash[a];
+    ngram_hash_keys[slot] = old_keys[a];
+  }
+  free(old_hash);
+  free(old_keys);
+}
+
+// Adds the vocabulary entry a, an ngram of order >= 2 with the given HashNgram, to the ngram hash.
+// The hash doubles when it gets 70% full
+void AddNgramToHash(long long a, unsigned long long hash) {
+  long long slot;
+  if (ngram_hash_used + 1 > ngram_hash_size * 0.7) ResizeNgramHash(ngram_hash_size * 2 + 1);
+  slot = HashSlot(hash, ngram_hash_size);
+  while (ngram_hash[slot] != -1) slot = (slot + 1) % ngram_hash_size;
+  ngram_hash[slot] = a;
+  ngram_hash_keys[slot] = hash;
+  ngram_hash_used++;
+}
+
+// Adds the word a of the vocabulary to the word hash
+void AddWordToHash(long long a) {
+  unsigned long long hash = HashSlot(HashString(VocabWord(a), strlen(VocabWord(a))), vocab_hash_size);
+  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
+  vocab_hash[hash] = a;
+}
+
+// Allocates the word hash with the given number of slots and adds the words to it
+void ResizeVocabHash(long long size) {
+  long long a;
+  free(vocab_hash);
+  vocab_hash_size = size;
+  vocab_hash = (int *)malloc(vocab_hash_size * sizeof(int));
+  if (vocab_hash == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  for (a = 0; a < vocab_size; a++) AddWordToHash(a);
+}
+
+// Makes room for one more entry at the end of the vocabulary. The vocabulary grows by doubling
+void GrowVocab() {
   if (ngram_size + 2 >= ngram_max_size) {
-    ngram_max_size += 1000;
+    ngram_max_size *= 2;
     ngram_infos = (struct ngram_info *)realloc(ngram_infos, ngram_max_size * sizeof(struct ngram_info));
+    ngram_words = (int *)realloc(ngram_words, ngram_max_size * ngrams * sizeof(int));
+    if (ngram_infos == NULL || ngram_words == NULL) {printf("Memory allocation failed\n"); exit(1);}
   }
-  hash = GetWordHash(word);
-  while (ngram_hash[hash] != -1) hash = (hash + 1) % ngram_hash_size;
-  ngram_hash[hash] = ngram_size - 1;
+}
+
+// Adds a word to the vocabulary; SortNgram builds the hash
+int AddWordToVocab(char *word) {
+  int i;
+  ngram_infos[ngram_size].word = AddString(&vocab_strings, word, strlen(word));
+  ngram_infos[ngram_size].cn = 0;
+  ngram_words[ngram_size * ngrams] = ngram_size;
+  for (i = 1; i < ngrams; i++) ngram_words[ngram_size * ngrams + i] = -1;
+  ngram_size++;
+  vocab_size++;
+  GrowVocab();
   return ngram_size - 1;
 }
 
-// Used later for sorting by word counts
-int VocabCompare(const void *a, const void *b) {
-    int a_has_space = (strchr(((struct ngram_info *)a)->word, ' ') != NULL);
-    int b_has_space = (strchr(((struct ngram_info *)b)->word, ' ') != NULL);
-    if (a_has_space < b_has_space) {
-      return -1;
+// Writes the words of an ngram separated by spaces
+void PrintNgram(FILE *fo, long long a) {
+  int i, *wids = ngram_words + a * ngrams, order = NgramOrder(wids);
+  for (i = 0; i < order; i++) {
+    if (i) fputc(' ', fo);
+    fputs(VocabWord(wids[i]), fo);
+  }
+}
+
+// Writes the words of an ngram, separated by spaces and ended by 0, to s; returns the length
+int NgramName(long long a, char *s) {
+  int i, len = 0, *wids = ngram_words + a * ngrams, order = NgramOrder(wids);
+  char *w;
+  for (i = 0; i < order; i++) {
+    if (i) s[len++] = ' ';
+    for (w = VocabWord(wids[i]); *w; w++) s[len++] = *w;
+  }
+  s[len] = 0;
+  return len;
+}
+
+// Used later for sorting words by counts; equal counts are ordered by string so that the
+// vocabulary does not depend on the order in which the shards were merged
+int WordCompare(const void *a, const void *b) {
+  struct ngram_info *wa = &ngram_infos[*(long long *)a], *wb = &ngram_infos[*(long long *)b];
+  if (wa->cn != wb->cn) return wa->cn > wb->cn ? -1 : 1;
+  return strcmp(vocab_strings.data + wa->word, vocab_strings.data + wb->word);
+}
+
+// Used later for sorting the longer ngrams by counts; equal counts are ordered by word ids
+int NgramCompare(const void *a, const void *b) {
+  long long ia = *(long long *)a, ib = *(long long *)b;
+  int i, *wa = ngram_words + ia * ngrams, *wb = ngram_words + ib * ngrams;
+  if (ngram_infos[ia].cn != ngram_infos[ib].cn) return ngram_infos[ia].cn > ngram_infos[ib].cn ? -1 : 1;
+  for (i = 0; i < ngrams; i++) if (wa[i] != wb[i]) return wa[i] < wb[i] ? -1 : 1;
+  return 0;
+}
+
+// Builds the hashes of a vocabulary in its final order, and the arrays of the Huffman codes
+void IndexVocab() {
+  long long a, b;
+  ResizeVocabHash(vocab_size * 2 + 1);
+  // The ngram hash starts at the size the ngrams need, not at a fixed maximum
+  free(ngram_hash);
+  free(ngram_hash_keys);
+  ngram_hash = NULL;
+  ngram_hash_keys = NULL;
+  ngram_hash_used = 0;
+  ResizeNgramHash((ngram_size - vocab_size) * 2 + 1024);
+  for (a = vocab_size; a < ngram_size; a++) {
+    b = NgramOrder(ngram_words + a * ngrams);
+    AddNgramToHash(a, HashNgram(ngram_words + a * ngrams, b));
+  }
+  // Allocate memory for the binary tree construction, in two flat arrays
+  free(vocab_codes);
+  free(vocab_points);
+  vocab_points = NULL;
+  vocab_codes = (unsigned long long *)calloc(vocab_size, sizeof(unsigned long long));
+  a = posix_memalign((void **)&vocab_points, 64, vocab_size * MAX_CODE_LENGTH * sizeof(int));
+  if (vocab_codes == NULL || vocab_points == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  memset(vocab_points, 0, vocab_size * MAX_CODE_LENGTH * sizeof(int));
+  tree_built = 0;
+}
+
+// Bytes taken while counting by one slot of a shard ngram table: the slot itself (infos and
+// words, which grow by doubling, the hash at 70% load, the SpaceSaving buckets and the partition
+// arrays), then its copies in a merged table and in ngram_infos
+long long CountEntryBytes() {
+  return 5 * (sizeof(struct ngram_info) + ngrams * sizeof(int)) + 64;
+}
+
+// Gives half of -max-memory to the shard ngram tables; the other half is left for the word
+// tables, which count exactly, and for sorting the vocabulary
+void PlanCounting() {
+  long long tables = num_threads * (ngrams > 1 ? ngrams - 1 : 1);
+  count_hash_size = max_memory / 2 / CountEntryBytes() / 0.7;
+  if (count_hash_size > (1LL << 30) * tables) count_hash_size = (1LL << 30) * tables;
+  if (debug_mode > 0 && ngrams > 1) printf("Memory plan: counting %lld MB, %lld ngrams per table\n", max_memory / 2 >> 20,
+                                           (long long)(count_hash_size / tables * 0.7));
+}
+
+// Fills parts with the memory that training takes with that many words and entries (words and
+// ngrams) in the vocabulary, and returns their sum
+long long PlanMemory(long long words, long long entries, long long *parts) {
+  long long copies = 1;
+  parts[PLAN_WEIGHTS] = (entries + buckets) * layer1_size * (storage == STORAGE_F32 ? sizeof(real) : sizeof(unsigned short));
+  if (hs) parts[PLAN_WEIGHTS] += words * layer1_size * sizeof(real);
+  if (negative > 0) parts[PLAN_WEIGHTS] += words * layer1_size * (storage_outputs ? sizeof(unsigned short) : sizeof(real));
+  // The shared model and two copies per worker process; a checkpoint process may copy all of it
+  if (workers > 1) copies = 2 + 2 * workers;
+  if (checkpoint_file[0] != 0) copies++;
+  parts[PLAN_WEIGHTS] *= copies;
+  // ngram_infos and ngram_words, the strings, both hashes, the Huffman codes and the arrays that
+  // build the tree; a stream also has its candidate tables and reserves the longest strings
+  parts[PLAN_VOCAB] = entries * (sizeof(struct ngram_info) + ngrams * sizeof(int)) + vocab_strings.size
+    + (entries - words) * 2 * (sizeof(int) + sizeof(unsigned long long)) + words * 2 * sizeof(int)
+    + words * (sizeof(unsigned long long) + MAX_CODE_LENGTH * sizeof(int)) + words * 2 * (sizeof(long long) + sizeof(int) + sizeof(char));
+  if (stream) parts[PLAN_VOCAB] += (words - 1) * (2 * MAX_STRING + ngrams * CountEntryBytes());
+  // The alias table and the arrays that build it; a stream builds a new one while the old one is used
+  parts[PLAN_SAMPLER] = negative > 0 ? words * (sizeof(struct alias_slot) + 2 * sizeof(double)) * (stream ? 2 : 1) : 0;
+  // Per thread: the buffers of TrainModelThread, the corpus it reads (its chunk and the read
+  // ahead, or the stream blocks), its two copies of the -hot-rows and the buffer of the text
+  // output, which grows by doubling. The program itself takes a few MB
+  parts[PLAN_THREADS] = ((2 * window * ngrams * 2 + 2 * (negative + 1) + 3) * layer1_size
+                         + 2 * (MAX_CODE_LENGTH + 2 * window * ngrams) * (negative + 1)) * sizeof(real);
+  parts[PLAN_THREADS] += 2 * ((negative > 0) + hs) * (hot_rows < words ? hot_rows : words) * layer1_size * sizeof(real);
+  if (stream) parts[PLAN_THREADS] += 2 * STREAM_BLOCK * ngrams * sizeof(int);
+  else parts[PLAN_THREADS] += 2 * (total_words / num_threads / 16 < 1 << 20 ? total_words / num_threads / 16 + 1024 : 1 << 20) * ngrams * sizeof(int);
+  if (binary == 0) parts[PLAN_THREADS] += 2 * EXPORT_BLOCK_ROWS * (ngrams * MAX_STRING + layer1_size * (precision + 4));
+  parts[PLAN_THREADS] = parts[PLAN_THREADS] * num_threads + (4 << 20);
+  // The blocks of the text pipeline, ready and being filled
+  if (text_pipeline) parts[PLAN_THREADS] += (long long)decompress_threads * (TEXT_AHEAD + 1) * TEXT_BLOCK;
+  return parts[PLAN_WEIGHTS] + parts[PLAN_VOCAB] + parts[PLAN_SAMPLER] + parts[PLAN_THREADS];
+}
+
+// Returns the memory of the model that keeps k words and k ngrams of each order, as -max-ngrams
+// would, when counted[i] of order i were counted (k of each for a stream)
+long long PlanNgrams(long long k, long long *counted) {
+  long long words = (stream || counted[1] > k ? k : counted[1]) + 1, entries = words, parts[PLAN_PARTS];
+  int i;
+  for (i = 2; i <= ngrams; i++) entries += stream || counted[i] > k ? k : counted[i];
+  return PlanMemory(words, entries, parts);
+}
+
+// Returns the largest k for which PlanNgrams fits in -max-memory, 0 if none does
+long long FitNgrams(long long *counted) {
+  long long lo = 0, hi = 1, mid;
+  int i;
+  // The ids of a stream stay far below the int limit
+  if (stream) {
+    while (hi * 2 < (1LL << 30) / ngrams && PlanNgrams(hi * 2, counted) <= max_memory) hi *= 2;
+    hi = hi * 2 - 1;
+  } else for (i = 1; i <= ngrams; i++) if (counted[i] > hi) hi = counted[i];
+  if (!stream && PlanNgrams(hi, counted) <= max_memory) return hi;
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (PlanNgrams(mid, counted) <= max_memory) lo = mid; else hi = mid - 1;
+  }
+  return lo;
+}
+
+// Lowers -max-ngrams to what fits in -max-memory, given the counted vocabulary
+void FitVocab() {
+  long long a, k, counted[MAX_NGRAM + 1];
+  int i;
+  for (i = 0; i <= MAX_NGRAM; i++) counted[i] = 0;
+  counted[1] = vocab_size - 1;
+  for (a = vocab_size; a < ngram_size; a++) counted[NgramOrder(ngram_words + a * ngrams)]++;
+  k = FitNgrams(counted);
+  if (k == 0) {
+    printf("ERROR: -max-memory cannot hold a model of even one word\n");
+    exit(1);
+  }
+  for (i = 1; i <= ngrams; i++) if (counted[i] > k && (max_ngrams == 0 || k < max_ngrams)) break;
+  if (i > ngrams) return;
+  max_ngrams = k;
+  if (debug_mode > 0) printf("Memory plan: keeping %lld words and ngrams of each order\n", k);
+}
+
+// Prints the memory that training will take with the vocabulary, and stops if it is more than
+// -max-memory (a resumed vocabulary cannot be cut)
+void ReportMemoryPlan() {
+  long long parts[PLAN_PARTS], words = vocab_size, entries = ngram_size, total;
+  int i;
+  if (stream) {
+    words = stream_ngram_base;
+    entries = stream_ngram_base + max_ngrams * (ngrams - 1);
+    if (debug_mode > 0) printf("Memory plan: room for %lld words and ngrams of each order\n", max_ngrams);
+  }
+  total = PlanMemory(words, entries, parts);
+  if (debug_mode > 0) {
+    printf("Memory plan:");
+    for (i = 0; i < PLAN_PARTS; i++) printf(" %s %lld MB,", plan_names[i], parts[i] >> 20);
+    printf(" total %lld MB of %lld MB\n", total >> 20, max_memory >> 20);
+  }
+  if (total > max_memory) {
+    printf("ERROR: the model needs %lld MB, more than -max-memory\n", total >> 20);
+    exit(1);
+  }
+}
+
+// Drops the pages of [begin, end) of a mapped file from the memory of the process, with
+// -max-memory; they are read again from the page cache if needed
+void ReleasePages(char *map, long long begin, long long end) {
+  long long page = sysconf(_SC_PAGESIZE);
+  begin = (begin + page - 1) / page * page;
+  end = end / page * page;
+  if (max_memory > 0 && map != NULL && end > begin) madvise(map + begin, end - begin, MADV_DONTNEED);
+}
+
+// Sorts the vocabulary by frequency using word counts. The first vocab_size entries are words,
+// with </s> kept at the first position; the longer ngrams follow and their word ids are
+// rewritten to the sorted positions of their words. With -max-ngrams, lowered by -max-memory to
+// what fits, only the most frequent words and ngrams of each order are kept, and ngrams with a dropped word are dropped too.
+// The words are packed again in sorted order, so the strings of dropped words are freed
+void SortNgram() {
+  long long a, size, kept[MAX_NGRAM], *order = (long long *)malloc((ngram_size + 1) * sizeof(long long));
+  int i, dropped, *wids, *new_id = (int *)malloc((vocab_size + 1) * sizeof(int));
+  struct ngram_info *infos = (struct ngram_info *)calloc(ngram_max_size, sizeof(struct ngram_info));
+  int *words = (int *)malloc(ngram_max_size * ngrams * sizeof(int));
+  struct string_arena strings = {NULL, 0, 0};
+  double t = Now();
+  if (order == NULL || new_id == NULL || infos == NULL || words == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  if (max_memory > 0 && !stream) FitVocab();
+  for (a = 0; a < ngram_size; a++) order[a] = a;
+  qsort(&order[1], vocab_size - 1, sizeof(long long), WordCompare);
+  if (max_ngrams > 0 && vocab_size > max_ngrams + 1) {
+    memmove(&order[max_ngrams + 1], &order[vocab_size], (ngram_size - vocab_size) * sizeof(long long));
+    ngram_size -= vocab_size - max_ngrams - 1;
+    for (a = 0; a < vocab_size; a++) new_id[a] = -1;
+    vocab_size = max_ngrams + 1;
+  }
+  for (a = 0; a < vocab_size; a++) new_id[order[a]] = a;
+  // The longer ngrams still refer to the old word positions; rewrite them and drop the ngrams
+  // that contain a dropped word
+  size = vocab_size;
+  for (a = vocab_size; a < ngram_size; a++) {
+    wids = ngram_words + order[a] * ngrams;
+    dropped = 0;
+    for (i = 0; i < ngrams && wids[i] >= 0; i++) {
+      wids[i] = new_id[wids[i]];
+      if (wids[i] < 0) dropped = 1;
     }
-    if (a_has_space > b_has_space) {
-      return 1;
+    if (!dropped) order[size++] = order[a];
+  }
+  ngram_size = size;
+  qsort(&order[vocab_size], ngram_size - vocab_size, sizeof(long long), NgramCompare);
+  if (max_ngrams > 0) {
+    for (i = 0; i < MAX_NGRAM; i++) kept[i] = 0;
+    size = vocab_size;
+    for (a = vocab_size; a < ngram_size; a++) {
+      i = NgramOrder(ngram_words + order[a] * ngrams);
+      if (kept[i]++ < max_ngrams) order[size++] = order[a];
     }
-    return ((struct ngram_info *)b)->cn - ((struct ngram_info *)a)->cn;
+    ngram_size = size;
+  }
+  for (a = 0; a < ngram_size; a++) {
+    infos[a] = ngram_infos[order[a]];
+    memcpy(words + a * ngrams, ngram_words + order[a] * ngrams, ngrams * sizeof(int));
+  }
+  for (a = 0; a < vocab_size; a++) {
+    words[a * ngrams] = a;
+    infos[a].word = AddString(&strings, vocab_strings.data + infos[a].word, strlen(vocab_strings.data + infos[a].word));
+  }
+  free(ngram_infos);
+  free(ngram_words);
+  free(vocab_strings.data);
+  ngram_infos = infos;
+  ngram_words = words;
+  vocab_strings = strings;
+  free(order);
+  free(new_id);
+  // Hashes will be re-computed, as after the sorting they are not actual
+  IndexVocab();
+  phase_time[PHASE_SORT] += Now() - t;
 }
 
-// Sorts the vocabulary by frequency using word counts
-void SortNgram() {
+// A table without a words array counts words, one with it counts ngrams of order >= 2.
+// A capacity > 0 makes it a bounded SpaceSaving table
+void InitTable(struct ngram_table *t, int hash_size, int count_ngrams, long long capacity) {
   int a;
-  unsigned int hash;
-  char is_multi_gram = 0;
-  // Sort the vocabulary and keep </s> at the first position
-  qsort(&ngram_infos[1], ngram_size - 1, sizeof(struct ngram_info), VocabCompare);
-  for (a = 0; a < ngram_hash_size; a++) ngram_hash[a] = -1;
-  vocab_size = 0;
-  for (a = 0; a < ngram_size; a++) {
-    // Hash will be re-computed, as after the sorting it is not actual
-    if ((!is_multi_gram) && (strchr(ngram_infos[a].word, ' ') == NULL)) {
-      vocab_size++;
-    } else {
-      is_multi_gram = 1;
+  memset(t, 0, sizeof(struct ngram_table));
+  t->max_size = 1000;
+  t->infos = (struct ngram_info *)calloc(t->max_size, sizeof(struct ngram_info));
+  if (count_ngrams) t->words = (int *)malloc(t->max_size * ngrams * sizeof(int));
+  t->hash_size = hash_size;
+  t->hash = (int *)malloc(hash_size * sizeof(int));
+  if (t->infos == NULL || t->hash == NULL || (count_ngrams && t->words == NULL)) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < hash_size; a++) t->hash[a] = -1;
+  t->capacity = capacity;
+  t->min_bucket = -1;
+}
+
+void FreeTable(struct ngram_table *t) {
+  free(t->infos);
+  free(t->words);
+  free(t->strings.data);
+  free(t->hash);
+  free(t->part_start);
+  free(t->part);
+  free(t->order);
+  free(t->remap);
+  free(t->err);
+  free(t->bucket_cn);
+  free(t->next);
+  free(t->prev);
+  free(t->bucket);
+  free(t->bucket_head);
+  free(t->bucket_next);
+  free(t->bucket_prev);
+}
+
+// Returns the string of an entry of a word table
+char *TableWord(struct ngram_table *t, long long a) {
+  return t->strings.data + t->infos[a].word;
+}
+
+// Returns the hash of an entry of the table, not yet reduced to a table size
+unsigned long long EntryHash(struct ngram_table *t, long long a) {
+  if (t->words == NULL) return HashString(TableWord(t, a), strlen(TableWord(t, a)));
+  return HashNgram(t->words + a * ngrams, NgramOrder(t->words + a * ngrams));
+}
+
+// Rebuilds the hash of the table with a new size
+void RehashTable(struct ngram_table *t, int hash_size) {
+  long long a;
+  unsigned long long hash;
+  free(t->hash);
+  t->hash_size = hash_size;
+  t->hash = (int *)malloc(hash_size * sizeof(int));
+  if (t->hash == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < t->hash_size; a++) t->hash[a] = -1;
+  for (a = 0; a < t->size; a++) {
+    hash = HashSlot(EntryHash(t, a), t->hash_size);
+    while (t->hash[hash] != -1) hash = (hash + 1) % t->hash_size;
+    t->hash[hash] = a;
+  }
+}
+
+// Adds an entry with the given hash to the table and returns its position
+long long AddToTable(struct ngram_table *t, unsigned long long hash) {
+  t->infos[t->size].word = 0;
+  t->infos[t->size].cn = 0;
+  t->size++;
+  if (t->size + 2 >= t->max_size) {
+    t->max_size *= 2;
+    t->infos = (struct ngram_info *)realloc(t->infos, t->max_size * sizeof(struct ngram_info));
+    if (t->words != NULL) t->words = (int *)realloc(t->words, t->max_size * ngrams * sizeof(int));
+  }
+  hash = HashSlot(hash, t->hash_size);
+  while (t->hash[hash] != -1) hash = (hash + 1) % t->hash_size;
+  t->hash[hash] = t->size - 1;
+  return t->size - 1;
+}
+
+// Returns position of a word with the given hash in a word table; the word is added if it is new.
+// Word tables are never reduced, as the ngram tables refer to their positions
+long long AddWordToTable(struct ngram_table *t, char *word, int len, unsigned long long hash) {
+  unsigned long long h = HashSlot(hash, t->hash_size);
+  long long a;
+  char *w;
+  while (t->hash[h] != -1) {
+    w = TableWord(t, t->hash[h]);
+    if (!strncmp(word, w, len) && w[len] == 0) return t->hash[h];
+    h = (h + 1) % t->hash_size;
+  }
+  a = AddToTable(t, hash);
+  t->infos[a].word = AddString(&t->strings, word, len);
+  if (t->size > t->hash_size * 0.7) RehashTable(t, t->hash_size * 2);
+  return a;
+}
+
+// Returns position of an ngram with the given hash in an ngram table, or -1
+long long SearchNgramTable(struct ngram_table *t, int *wids, int order, unsigned long long hash) {
+  hash = HashSlot(hash, t->hash_size);
+  while (1) {
+    if (t->hash[hash] == -1) return -1;
+    if (NgramEquals(t->words + (long long)t->hash[hash] * ngrams, wids, order)) return t->hash[hash];
+    hash = (hash + 1) % t->hash_size;
+  }
+  return -1;
+}
+
+// Adds an ngram with the given hash to an ngram table
+long long AddNgramToTable(struct ngram_table *t, int *wids, int order, unsigned long long hash) {
+  long long a = AddToTable(t, hash);
+  int i;
+  for (i = 0; i < ngrams; i++) t->words[a * ngrams + i] = i < order ? wids[i] : -1;
+  return a;
+}
+
+// Links entry e at the head of bucket b
+void BucketLink(struct ngram_table *t, int e, int b) {
+  t->bucket[e] = b;
+  t->prev[e] = -1;
+  t->next[e] = t->bucket_head[b];
+  if (t->next[e] != -1) t->prev[t->next[e]] = e;
+  t->bucket_head[b] = e;
+  t->infos[e].cn = t->bucket_cn[b];
+}
+
+// Unlinks entry e from its bucket, and frees the bucket if it became empty
+void BucketUnlink(struct ngram_table *t, int e) {
+  int b = t->bucket[e];
+  if (t->prev[e] != -1) t->next[t->prev[e]] = t->next[e]; else t->bucket_head[b] = t->next[e];
+  if (t->next[e] != -1) t->prev[t->next[e]] = t->prev[e];
+  if (t->bucket_head[b] != -1) return;
+  if (t->bucket_prev[b] != -1) t->bucket_next[t->bucket_prev[b]] = t->bucket_next[b]; else t->min_bucket = t->bucket_next[b];
+  if (t->bucket_next[b] != -1) t->bucket_prev[t->bucket_next[b]] = t->bucket_prev[b];
+  t->bucket_next[b] = t->free_bucket;
+  t->free_bucket = b;
+}
+
+// Returns a new empty bucket with the given count, linked after bucket 'after' (-1 for the front)
+int NewBucket(struct ngram_table *t, long long cn, int after) {
+  int b = t->free_bucket;
+  t->free_bucket = t->bucket_next[b];
+  t->bucket_cn[b] = cn;
+  t->bucket_head[b] = -1;
+  t->bucket_prev[b] = after;
+  t->bucket_next[b] = after == -1 ? t->min_bucket : t->bucket_next[after];
+  if (t->bucket_next[b] != -1) t->bucket_prev[t->bucket_next[b]] = b;
+  if (after == -1) t->min_bucket = b; else t->bucket_next[after] = b;
+  return b;
+}
+
+// Adds one to the count of entry e, keeping the buckets in count order
+void IncrementEntry(struct ngram_table *t, int e) {
+  int b = t->bucket[e], nb = t->bucket_next[b];
+  long long cn = t->bucket_cn[b] + 1;
+  if (nb == -1 || t->bucket_cn[nb] != cn) {
+    if (t->bucket_head[b] == e && t->next[e] == -1) {
+      // Alone in its bucket, which can simply take the new count
+      t->bucket_cn[b] = cn;
+      t->infos[e].cn = cn;
+      return;
     }
-    hash=GetWordHash(ngram_infos[a].word);
-    while (ngram_hash[hash] != -1) hash = (hash + 1) % ngram_hash_size;
-    ngram_hash[hash] = a;
+    nb = NewBucket(t, cn, b);
   }
-  // Allocate memory for the binary tree construction
-  for (a = 0; a < vocab_size; a++) {
-    ngram_infos[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
-    ngram_infos[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
+  BucketUnlink(t, e);
+  BucketLink(t, e, nb);
+}
+
+// Removes entry e from the hash of the table, shifting back the entries that probed past it
+void UnhashEntry(struct ngram_table *t, int e) {
+  long long i = HashSlot(EntryHash(t, e), t->hash_size), j, k;
+  while (t->hash[i] != e) i = (i + 1) % t->hash_size;
+  j = i;
+  while (1) {
+    j = (j + 1) % t->hash_size;
+    if (t->hash[j] == -1) break;
+    k = HashSlot(EntryHash(t, t->hash[j]), t->hash_size);
+    // The entry at j may move to i unless its home slot k lies cyclically in (i, j]
+    if ((j > i && (k <= i || k > j)) || (j < i && k <= i && k > j)) {
+      t->hash[i] = t->hash[j];
+      i = j;
+    }
   }
+  t->hash[i] = -1;
 }
 
-// Reduces the vocabulary by removing infrequent tokens
-void ReduceNgram() {
-  min_reduce *= 2;
-  int a, b = 1;
-  unsigned int hash;
-  for (a = 1; a < ngram_size; a++) if (ngram_infos[a].cn > 1) {
-    ngram_infos[b].cn = ngram_infos[a].cn/2;
-    ngram_infos[b].word = ngram_infos[a].word;
-    b++;
-  } else {
-    if (rand()%2) {
-      free(ngram_infos[a].word);
-    } else {
-      ngram_infos[b].cn = ngram_infos[a].cn;
-      ngram_infos[b].word = ngram_infos[a].word;
-      b++;
+// Orders (count, entry) pairs by increasing count
+int CountCompare(const void *a, const void *b) {
+  long long c = ((long long *)a)[0] - ((long long *)b)[0];
+  return c < 0 ? -1 : c > 0;
+}
+
+// Groups the entries of a full table into buckets of equal count, in increasing count order.
+// The table never grows after this, so the buckets can be sized once
+void BuildBuckets(struct ngram_table *t) {
+  long long a, n = t->size + 1, *sorted = (long long *)malloc(t->size * 2 * sizeof(long long));
+  int b = -1;
+  t->err = (long long *)calloc(n, sizeof(long long));
+  t->bucket_cn = (long long *)malloc(n * sizeof(long long));
+  t->next = (int *)malloc(n * sizeof(int));
+  t->prev = (int *)malloc(n * sizeof(int));
+  t->bucket = (int *)malloc(n * sizeof(int));
+  t->bucket_head = (int *)malloc(n * sizeof(int));
+  t->bucket_next = (int *)malloc(n * sizeof(int));
+  t->bucket_prev = (int *)malloc(n * sizeof(int));
+  if (sorted == NULL || t->err == NULL || t->bucket_cn == NULL || t->next == NULL || t->prev == NULL || t->bucket == NULL
+      || t->bucket_head == NULL || t->bucket_next == NULL || t->bucket_prev == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < n; a++) t->bucket_next[a] = a + 1 < n ? a + 1 : -1;
+  t->free_bucket = 0;
+  for (a = 0; a < t->size; a++) {
+    sorted[a * 2] = t->infos[a].cn;
+    sorted[a * 2 + 1] = a;
+  }
+  qsort(sorted, t->size, 2 * sizeof(long long), CountCompare);
+  for (a = 0; a < t->size; a++) {
+    if (b == -1 || t->bucket_cn[b] != sorted[a * 2]) b = NewBucket(t, sorted[a * 2], b);
+    BucketLink(t, sorted[a * 2 + 1], b);
+  }
+  free(sorted);
+}
+
+// Takes the entry with the minimum count of a full SpaceSaving table for a new key: the count is
+// kept as the error of the new key and the entry leaves the hash. The caller stores the key,
+// calls HashEntry and counts the occurrence
+long long EvictMinEntry(struct ngram_table *t) {
+  long long e;
+  if (t->min_bucket == -1) BuildBuckets(t);
+  e = t->bucket_head[t->min_bucket];
+  t->err[e] = t->bucket_cn[t->min_bucket];
+  UnhashEntry(t, e);
+  return e;
+}
+
+// Puts entry e of a table, whose key has the given hash, into the hash
+void HashEntry(struct ngram_table *t, long long e, unsigned long long hash) {
+  long long slot = HashSlot(hash, t->hash_size);
+  while (t->hash[slot] != -1) slot = (slot + 1) % t->hash_size;
+  t->hash[slot] = e;
+}
+
+// Counts one occurrence of an ngram with the given hash in a SpaceSaving table. Until the table
+// is full this is plain counting; the count-ordered buckets are built once when the first ngram
+// has to be replaced, after which each update takes constant time. Returns the ngram's entry
+long long CountNgram(struct ngram_table *t, int *wids, int order, unsigned long long hash) {
+  long long e = SearchNgramTable(t, wids, order, hash);
+  int i;
+  if (e != -1) {
+    if (t->min_bucket == -1) t->infos[e].cn++; else IncrementEntry(t, e);
+    return e;
+  }
+  if (t->size < t->capacity) {
+    e = AddNgramToTable(t, wids, order, hash);
+    t->infos[e].cn = 1;
+    // The hash starts small and grows up to the size that holds 'capacity' ngrams at 70% load
+    if (t->size > t->hash_size * 0.7) RehashTable(t, t->hash_size * 2 < t->capacity / 0.7 ? t->hash_size * 2 : t->capacity / 0.7 + 1);
+    return e;
+  }
+  // Replace an ngram with the minimum count
+  e = EvictMinEntry(t);
+  for (i = 0; i < ngrams; i++) t->words[e * ngrams + i] = i < order ? wids[i] : -1;
+  HashEntry(t, e, hash);
+  IncrementEntry(t, e);
+  return e;
+}
+
+// As CountNgram, for a table of words. The words of such a table have fixed slots of
+// MAX_STRING bytes in its arena, see InitWordCandidates, so a replaced word's slot is reused
+long long CountWord(struct ngram_table *t, char *word, int len, unsigned long long hash) {
+  unsigned long long h = HashSlot(hash, t->hash_size);
+  long long e;
+  char *w;
+  while (t->hash[h] != -1) {
+    w = TableWord(t, t->hash[h]);
+    if (!strncmp(word, w, len) && w[len] == 0) {
+      e = t->hash[h];
+      if (t->min_bucket == -1) t->infos[e].cn++; else IncrementEntry(t, e);
+      return e;
     }
+    h = (h + 1) % t->hash_size;
   }
-  ngram_size = b;
-  for (a = 0; a < ngram_hash_size; a++) ngram_hash[a] = -1;
-  for (a = 0; a < ngram_size; a++) {
-    // Hash will be re-computed, as it is not actual
-    hash = GetWordHash(ngram_infos[a].word);
-    while (ngram_hash[hash] != -1) hash = (hash + 1) % ngram_hash_size;
-    ngram_hash[hash] = a;
+  if (t->size < t->capacity) {
+    e = AddToTable(t, hash);
+    t->infos[e].word = e * MAX_STRING;
+    t->infos[e].cn = 1;
+    memcpy(TableWord(t, e), word, len);
+    TableWord(t, e)[len] = 0;
+    if (t->size > t->hash_size * 0.7) RehashTable(t, t->hash_size * 2 < t->capacity / 0.7 ? t->hash_size * 2 : t->capacity / 0.7 + 1);
+    return e;
   }
-  fflush(stdout);
+  e = EvictMinEntry(t);
+  memcpy(TableWord(t, e), word, len);
+  TableWord(t, e)[len] = 0;
+  HashEntry(t, e, hash);
+  IncrementEntry(t, e);
+  return e;
+}
+
+// Returns the count of an entry of a SpaceSaving table that it surely has: its count less the
+// count of the entry it replaced
+long long GuaranteedCount(struct ngram_table *t, long long e) {
+  return t->infos[e].cn - (t->err != NULL ? t->err[e] : 0);
+}
+
+// Drops the count of entry e of a SpaceSaving table to 0, so that it is the next one replaced.
+// It stays in the hash until then; it is not found again as its key is only searched while
+// it is not in the vocabulary
+void DropEntry(struct ngram_table *t, long long e) {
+  int b;
+  if (t->min_bucket == -1) {
+    t->infos[e].cn = 0;
+    return;
+  }
+  t->err[e] = 0;
+  BucketUnlink(t, e);
+  b = t->min_bucket != -1 && t->bucket_cn[t->min_bucket] == 0 ? t->min_bucket : NewBucket(t, 0, -1);
+  BucketLink(t, e, b);
 }
 
 // Create binary Huffman tree using the word counts
 // Frequent words will have short uniqe binary codes
 void CreateBinaryTree() {
   long long a, b, i, min1i, min2i, pos1, pos2, point[MAX_CODE_LENGTH];
-  char code[MAX_CODE_LENGTH];
+  unsigned long long code;
+  int *points;
   long long *count = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-  long long *binary = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-  long long *parent_node = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
+  char *binary = (char *)calloc(vocab_size * 2 + 1, sizeof(char));
+  int *parent_node = (int *)calloc(vocab_size * 2 + 1, sizeof(int));
+  double t = Now();
+  if (count == NULL || binary == NULL || parent_node == NULL) {printf("Memory allocation failed\n"); exit(1);}
   for (a = 0; a < vocab_size; a++) count[a] = ngram_infos[a].cn;
   for (a = vocab_size; a < vocab_size * 2; a++) count[a] = 1e15;
   pos1 = vocab_size - 1;
@@ -252,156 +1307,1829 @@ void CreateBinaryTree() {
     parent_node[min2i] = vocab_size + a;
     binary[min2i] = 1;
   }
-  // Now assign binary code to each vocabulary word
+  // Now assign binary code to each vocabulary word, as bits from the root down
   for (a = 0; a < vocab_size; a++) {
     b = a;
     i = 0;
+    code = 0;
     while (1) {
-      code[i] = binary[b];
+      code = code << 1 | binary[b];
       point[i] = b;
       i++;
       b = parent_node[b];
       if (b == vocab_size * 2 - 2) break;
     }
     ngram_infos[a].codelen = i;
-    ngram_infos[a].point[0] = vocab_size - 2;
-    for (b = 0; b < i; b++) {
-      ngram_infos[a].code[i - b - 1] = code[b];
-      ngram_infos[a].point[i - b] = point[b] - vocab_size;//path from root to leaf
-    }
+    vocab_codes[a] = code;
+    points = vocab_points + a * MAX_CODE_LENGTH;
+    points[0] = vocab_size - 2;
+    for (b = 0; b < i; b++) points[i - b] = point[b] - vocab_size;//path from root to leaf
+  }
+  free(count);
+  free(binary);
+  free(parent_node);
+  tree_built = 1;
+  phase_time[PHASE_HUFFMAN] += Now() - t;
+}
+
+// Returns the partition of the merge that an entry with the given hash belongs to
+int MergePartition(unsigned long long hash) {
+  return ((hash * 0x9E3779B97F4A7C15ULL) >> 32) % num_threads;
+}
+
+// Returns the offset of the first sentence that starts at or after pos in the training text
+long long TextSentenceStart(long long pos) {
+  if (pos <= 0) return 0;
+  while (pos < train_text_size && train_text[pos - 1] != '\n') pos++;
+  return pos;
+}
+
+// Lists the entries of a shard grouped by merge partition, so that each merge thread reads one
+// contiguous slice of 'order'
+void GroupByPartition(struct ngram_table *t) {
+  long long a, *next = (long long *)calloc(num_threads + 1, sizeof(long long));
+  int p;
+  free(t->hash);
+  t->hash = NULL;
+  t->part = (int *)malloc((t->size + 1) * sizeof(int));
+  t->order = (int *)malloc((t->size + 1) * sizeof(int));
+  t->part_start = (long long *)calloc(num_threads + 1, sizeof(long long));
+  for (a = 0; a < t->size; a++) {
+    t->part[a] = MergePartition(EntryHash(t, a));
+    t->part_start[t->part[a] + 1]++;
+  }
+  for (p = 0; p < num_threads; p++) t->part_start[p + 1] += t->part_start[p];
+  for (p = 0; p < num_threads; p++) next[p] = t->part_start[p];
+  for (a = 0; a < t->size; a++) t->order[next[t->part[a]]++] = a;
+  free(next);
+}
+
+// Returns the table of a shard that counts the ngrams of order n >= 2
+struct ngram_table *ShardGrams(long long shard, int n) {
+  return &shard_grams[shard * (ngrams - 1) + n - 2];
+}
+
+// Counts the words and ngrams of a sentence-aligned piece of text into the tables of a shard.
+// local_words counts the words of the shard; with the mapped training file, its pages up to
+// where the counting is are released as it goes
+void CountText(long long id, struct token_reader *tr, long long *local_words, long long *released) {
+  char *word;
+  struct ngram_table *wt = &shard_words[id];
+  unsigned long long hash;
+  long long words_done, sentence_words = 0;
+  int wids[MAX_NGRAM];
+  int n, len;
+  while ((word = ReadToken(tr, &len)) != NULL) {
+    if (len == 4 && !memcmp(word, "</s>", 4)) {
+      sentence_words = 0;
+      continue;
+    }
+    ++*local_words;
+    if (*local_words % 100000 == 0) {
+      if (!text_pipeline) {
+        ReleasePages(train_text, *released, tr->pos - train_text);
+        *released = tr->pos - train_text;
+      }
+      words_done = __sync_add_and_fetch(&total_words, 100000);
+      if (debug_mode > 1) {
+        printf("%lldK%c", words_done / 1000, 13);
+        fflush(stdout);
+      }
+    }
+    for (n = 0; n + 1 < ngrams; n++) wids[n] = wids[n + 1];
+    wids[ngrams - 1] = AddWordToTable(wt, word, len, HashString(word, len));
+    wt->infos[wids[ngrams - 1]].cn++;
+    sentence_words++;
+    hash = wids[ngrams - 1] + 1;
+    for (n = 2; n <= ngrams && n <= sentence_words; n++) {
+      hash = hash * NGRAM_HASH_MUL + wids[ngrams - n] + 1;
+      CountNgram(ShardGrams(id, n), wids + ngrams - n, n, hash);
+    }
+  }
+}
+
+// Counts the words and the longer ngrams of one sentence-aligned byte range of the training file,
+// or of the blocks of the text pipeline it takes. Words get ids in the shard's word table first
+// and are counted exactly; ngrams are then keyed by those ids and counted by one SpaceSaving
+// table per order, which keeps the most frequent ones within a fixed capacity
+void *CountShardThread(void *id) {
+  struct token_reader tr;
+  struct ngram_table *wt = &shard_words[(long long)id], *nt;
+  long long a, local_words = 0, released = 0, size;
+  long long hash_size = count_hash_size / num_threads / (ngrams > 1 ? ngrams - 1 : 1);
+  char *block;
+  int n;
+  InitTable(wt, 1 << 16, 0, 0);
+  for (n = 2; n <= ngrams; n++) InitTable(ShardGrams((long long)id, n), hash_size < 1 << 16 ? hash_size : 1 << 16, 1, hash_size * 0.7);
+  if (text_pipeline) {
+    while ((block = TakeTextBlock(-1, &size)) != NULL) {
+      tr.pos = block;
+      tr.end = block + size;
+      CountText((long long)id, &tr, &local_words, &released);
+      free(block);
+    }
+  } else {
+    tr.pos = train_text + TextSentenceStart(train_text_size / num_threads * (long long)id);
+    tr.end = train_text + TextSentenceStart(train_text_size / num_threads * ((long long)id + 1));
+    if ((long long)id == num_threads - 1) tr.end = train_text + train_text_size;
+    released = tr.pos - train_text;
+    CountText((long long)id, &tr, &local_words, &released);
+  }
+  __sync_add_and_fetch(&total_words, local_words % 100000);
+  GroupByPartition(wt);
+  // Keep the guaranteed part of each count: an ngram that replaced another may have occurred
+  // up to err times before it was counted
+  for (n = 2; n <= ngrams; n++) {
+    nt = ShardGrams((long long)id, n);
+    for (a = 0; a < nt->size && nt->err != NULL; a++) nt->infos[a].cn -= nt->err[a];
+  }
+  pthread_exit(NULL);
+}
+
+// Sums the counts of the words that fall into one partition across all shard tables, and
+// records for each shard word its position in the partition. Partitions are disjoint, so the
+// merge threads never touch the same word
+void *MergeWordsThread(void *id) {
+  struct ngram_table *t = &merged_words[(long long)id], *shard;
+  long long a, i, k;
+  int s;
+  InitTable(t, 1 << 16, 0, 0);
+  for (s = 0; s < num_threads; s++) {
+    shard = &shard_words[s];
+    for (k = shard->part_start[(long long)id]; k < shard->part_start[(long long)id + 1]; k++) {
+      a = shard->order[k];
+      i = AddWordToTable(t, TableWord(shard, a), strlen(TableWord(shard, a)), EntryHash(shard, a));
+      t->infos[i].cn += shard->infos[a].cn;
+      shard->remap[a] = i;
+    }
+  }
+  pthread_exit(NULL);
+}
+
+// Rewrites the ngrams of one shard to the merged word ids and groups them by merge partition
+void *RemapShardThread(void *id) {
+  struct ngram_table *wt = &shard_words[(long long)id], *nt;
+  long long a;
+  int n;
+  for (a = 0; a < wt->size; a++) wt->remap[a] += word_offsets[wt->part[a]];
+  for (n = 2; n <= ngrams; n++) {
+    nt = ShardGrams((long long)id, n);
+    for (a = 0; a < nt->size * ngrams; a++) if (nt->words[a] >= 0) nt->words[a] = wt->remap[nt->words[a]];
+    GroupByPartition(nt);
+  }
+  pthread_exit(NULL);
+}
+
+// Sums the counts of the ngrams that fall into one partition across all shard tables. The shard
+// tables are bounded, so this sum is exact and never needs pruning
+void *MergeNgramsThread(void *id) {
+  struct ngram_table *t = &merged_grams[(long long)id], *shard;
+  unsigned long long hash;
+  long long a, i, k, s, size = 0;
+  int order;
+  for (s = 0; s < num_threads * (ngrams - 1); s++) {
+    size += shard_grams[s].part_start[(long long)id + 1] - shard_grams[s].part_start[(long long)id];
+  }
+  InitTable(t, size * 2 + 1000, 1, 0);
+  for (s = 0; s < num_threads * (ngrams - 1); s++) {
+    shard = &shard_grams[s];
+    for (k = shard->part_start[(long long)id]; k < shard->part_start[(long long)id + 1]; k++) {
+      a = shard->order[k];
+      order = NgramOrder(shard->words + a * ngrams);
+      hash = HashNgram(shard->words + a * ngrams, order);
+      i = SearchNgramTable(t, shard->words + a * ngrams, order, hash);
+      if (i == -1) i = AddNgramToTable(t, shard->words + a * ngrams, order, hash);
+      t->infos[i].cn += shard->infos[a].cn;
+      if (t->size > t->hash_size * 0.7) RehashTable(t, t->hash_size * 2);
+    }
+  }
+  pthread_exit(NULL);
+}
+
+// Runs one thread per shard or partition
+void RunThreads(void *(*f)(void *)) {
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  long long a;
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, f, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  free(pt);
+}
+
+// Counts the ngrams of the training file with one shard per thread, then merges the shards
+// in parallel: first the words, then the longer ngrams rewritten to the merged word ids.
+// Word counts are exact. Ngram counts are lower bounds, exact (and the same as counting with a
+// single thread) as long as no shard table of their order filled up; the deficit of any count
+// is at most the error bound of its order, the sum of the smallest counts of its full tables
+void LearnVocabFromTrainFile() {
+  long long a, b, kept, error;
+  struct ngram_table *nt;
+  int i;
+  if (text_pipeline) StartTextPipeline();
+  else train_text = MapFile(text_files[0].name, &train_text_size);
+  shard_words = (struct ngram_table *)calloc(num_threads, sizeof(struct ngram_table));
+  shard_grams = (struct ngram_table *)calloc(num_threads * (ngrams - 1) + 1, sizeof(struct ngram_table));
+  merged_words = (struct ngram_table *)calloc(num_threads, sizeof(struct ngram_table));
+  merged_grams = (struct ngram_table *)calloc(num_threads, sizeof(struct ngram_table));
+  word_offsets = (long long *)calloc(num_threads + 1, sizeof(long long));
+  total_words = 0;
+  if (max_memory > 0) PlanCounting();
+  RunThreads(CountShardThread);
+  if (text_pipeline) StopTextPipeline();
+  else if (train_text != NULL) munmap(train_text, train_text_size);
+  for (i = 2; i <= ngrams && debug_mode > 0; i++) {
+    kept = 0;
+    error = 0;
+    for (a = 0; a < num_threads; a++) {
+      nt = ShardGrams(a, i);
+      kept += nt->size;
+      if (nt->min_bucket != -1) error += nt->bucket_cn[nt->min_bucket];
+    }
+    printf("%d-grams kept in shards: %lld, count error bound: %lld\n", i, kept, error);
+  }
+  for (a = 0; a < num_threads; a++) shard_words[a].remap = (long long *)malloc((shard_words[a].size + 1) * sizeof(long long));
+  RunThreads(MergeWordsThread);
+  // </s> keeps the first position and the merged words follow
+  ngram_size = 1;
+  for (a = 0; a < num_threads; a++) {
+    word_offsets[a] = ngram_size;
+    ngram_size += merged_words[a].size;
+  }
+  vocab_size = ngram_size;
+  if (ngrams > 1) {
+    RunThreads(RemapShardThread);
+    RunThreads(MergeNgramsThread);
+    for (a = 0; a < num_threads; a++) ngram_size += merged_grams[a].size;
+  }
+  ngram_max_size = ngram_size + 1000;
+  ngram_infos = (struct ngram_info *)realloc(ngram_infos, ngram_max_size * sizeof(struct ngram_info));
+  ngram_words = (int *)realloc(ngram_words, ngram_max_size * ngrams * sizeof(int));
+  memset(ngram_infos, 0, ngram_max_size * sizeof(struct ngram_info));
+  // The merged word tables own the strings; copy their arenas one after another
+  free(vocab_strings.data);
+  vocab_strings.max_size = 5;
+  for (a = 0; a < num_threads; a++) vocab_strings.max_size += merged_words[a].strings.size;
+  vocab_strings.data = (char *)malloc(vocab_strings.max_size);
+  vocab_strings.size = 0;
+  if (vocab_strings.data == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  ngram_infos[0].word = AddString(&vocab_strings, (char *)"</s>", 4);
+  ngram_words[0] = 0;
+  for (i = 1; i < ngrams; i++) ngram_words[i] = -1;
+  for (a = 0; a < num_threads; a++) {
+    memcpy(vocab_strings.data + vocab_strings.size, merged_words[a].strings.data, merged_words[a].strings.size);
+    for (b = 0; b < merged_words[a].size; b++) {
+      ngram_infos[word_offsets[a] + b] = merged_words[a].infos[b];
+      ngram_infos[word_offsets[a] + b].word += vocab_strings.size;
+      ngram_words[(word_offsets[a] + b) * ngrams] = word_offsets[a] + b;
+      for (i = 1; i < ngrams; i++) ngram_words[(word_offsets[a] + b) * ngrams + i] = -1;
+    }
+    vocab_strings.size += merged_words[a].strings.size;
+  }
+  b = vocab_size;
+  for (a = 0; a < num_threads && ngrams > 1; a++) {
+    memcpy(ngram_infos + b, merged_grams[a].infos, merged_grams[a].size * sizeof(struct ngram_info));
+    memcpy(ngram_words + b * ngrams, merged_grams[a].words, merged_grams[a].size * ngrams * sizeof(int));
+    b += merged_grams[a].size;
+  }
+  for (a = 0; a < num_threads; a++) {
+    FreeTable(&shard_words[a]);
+    FreeTable(&merged_words[a]);
+    if (ngrams > 1) FreeTable(&merged_grams[a]);
+  }
+  for (a = 0; a < num_threads * (ngrams - 1); a++) FreeTable(&shard_grams[a]);
+  free(shard_words);
+  free(shard_grams);
+  free(merged_words);
+  free(merged_grams);
+  free(word_offsets);
+  SortNgram();
+  if (debug_mode > 0) {
+    printf("Vocab size: %lld\n", vocab_size);
+    printf("ngram size: %lld\n", ngram_size);
+    printf("Words in train file: %lld\n", total_words);
+  }
+}
+
+// Writes size bytes to a binary vocabulary, padded with zeros to a multiple of 64; with no data,
+// only pads what was written of that size
+void WriteVocabSection(void *data, long long size, FILE *fo) {
+  char zero[64] = {0};
+  if (data != NULL) fwrite(data, 1, size, fo);
+  fwrite(zero, 1, (64 - size % 64) % 64, fo);
+}
+
+// Saves the whole vocabulary, with its hashes and Huffman tree, in the format of vocab_header
+void SaveVocabBinary(FILE *fo) {
+  struct vocab_header header;
+  long long a, b, *buf = (long long *)malloc(4096 * sizeof(long long));
+  char *lens = (char *)malloc(vocab_size);
+  if (buf == NULL || lens == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  if (!tree_built) CreateBinaryTree();
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "NG2VVOCB", 8);
+  header.version = VOCAB_VERSION;
+  header.ngrams = ngrams;
+  header.vocab_size = vocab_size;
+  header.ngram_size = ngram_size;
+  header.strings_size = vocab_strings.size;
+  header.total_words = total_words;
+  header.vocab_hash_size = vocab_hash_size;
+  header.ngram_hash_size = ngram_hash_size;
+  header.ngram_hash_used = ngram_hash_used;
+  WriteVocabSection(&header, sizeof(header), fo);
+  // The counts and word offsets go through a buffer, as they are fields of ngram_info
+  for (b = 0; b < 2; b++) {
+    for (a = 0; a < ngram_size; a++) {
+      buf[a % 4096] = b == 0 ? ngram_infos[a].cn : ngram_infos[a].word;
+      if (a % 4096 == 4095 || a == ngram_size - 1) fwrite(buf, sizeof(long long), a % 4096 + 1, fo);
+    }
+    WriteVocabSection(NULL, ngram_size * sizeof(long long), fo);
+  }
+  WriteVocabSection(ngram_words, ngram_size * ngrams * sizeof(int), fo);
+  WriteVocabSection(vocab_hash, vocab_hash_size * sizeof(int), fo);
+  WriteVocabSection(ngram_hash, ngram_hash_size * sizeof(int), fo);
+  WriteVocabSection(ngram_hash_keys, ngram_hash_size * sizeof(unsigned long long), fo);
+  for (a = 0; a < vocab_size; a++) lens[a] = ngram_infos[a].codelen;
+  WriteVocabSection(lens, vocab_size, fo);
+  WriteVocabSection(vocab_codes, vocab_size * sizeof(unsigned long long), fo);
+  WriteVocabSection(vocab_points, vocab_size * MAX_CODE_LENGTH * sizeof(int), fo);
+  WriteVocabSection(vocab_strings.data, vocab_strings.size, fo);
+  free(buf);
+  free(lens);
+}
+
+// Returns the section of a mapped binary vocabulary at *offset, of size bytes, and moves the
+// offset past it
+void *VocabSection(char *map, long long map_size, long long *offset, long long size) {
+  void *p = map + *offset;
+  *offset += (size + 63) / 64 * 64;
+  if (*offset > map_size) {
+    printf("ERROR: vocabulary %s is truncated\n", read_vocab_file);
+    exit(1);
+  }
+  return p;
+}
+
+// Maps a vocabulary saved by SaveVocabBinary. The word ids, strings, hashes and Huffman codes
+// are used in place, from private pages of the file; only ngram_infos is filled
+void MapVocab() {
+  struct vocab_header *header;
+  long long a, size, offset = (sizeof(struct vocab_header) + 63) / 64 * 64, *counts, *words;
+  char *map, *lens;
+  int fd = open(read_vocab_file, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    printf("Vocabulary file not found\n");
+    exit(1);
+  }
+  size = st.st_size;
+  map = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    printf("ERROR: cannot map %s\n", read_vocab_file);
+    exit(1);
+  }
+  header = (struct vocab_header *)map;
+  if (size < (long long)sizeof(*header) || header->version != VOCAB_VERSION || header->ngrams != ngrams) {
+    printf("ERROR: %s is not a vocabulary of this version with the same -ngrams\n", read_vocab_file);
+    exit(1);
+  }
+  // The mapped arrays cannot grow or be cut
+  if (stream || max_ngrams > 0) {
+    printf("ERROR: a binary vocabulary cannot be used with -stream or -max-ngrams\n");
+    exit(1);
+  }
+  vocab_size = header->vocab_size;
+  ngram_size = header->ngram_size;
+  total_words = header->total_words;
+  vocab_hash_size = header->vocab_hash_size;
+  ngram_hash_size = header->ngram_hash_size;
+  ngram_hash_used = header->ngram_hash_used;
+  counts = (long long *)VocabSection(map, size, &offset, ngram_size * sizeof(long long));
+  words = (long long *)VocabSection(map, size, &offset, ngram_size * sizeof(long long));
+  ngram_words = (int *)VocabSection(map, size, &offset, ngram_size * ngrams * sizeof(int));
+  vocab_hash = (int *)VocabSection(map, size, &offset, vocab_hash_size * sizeof(int));
+  ngram_hash = (int *)VocabSection(map, size, &offset, ngram_hash_size * sizeof(int));
+  ngram_hash_keys = (unsigned long long *)VocabSection(map, size, &offset, ngram_hash_size * sizeof(unsigned long long));
+  lens = (char *)VocabSection(map, size, &offset, vocab_size);
+  vocab_codes = (unsigned long long *)VocabSection(map, size, &offset, vocab_size * sizeof(unsigned long long));
+  vocab_points = (int *)VocabSection(map, size, &offset, vocab_size * MAX_CODE_LENGTH * sizeof(int));
+  vocab_strings.data = (char *)VocabSection(map, size, &offset, header->strings_size);
+  vocab_strings.size = vocab_strings.max_size = header->strings_size;
+  ngram_max_size = ngram_size + 1;
+  free(ngram_infos);
+  ngram_infos = (struct ngram_info *)calloc(ngram_max_size, sizeof(struct ngram_info));
+  if (ngram_infos == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < ngram_size; a++) {
+    ngram_infos[a].cn = counts[a];
+    ngram_infos[a].word = words[a];
+  }
+  for (a = 0; a < vocab_size; a++) ngram_infos[a].codelen = lens[a];
+  tree_built = 1;
+  if (debug_mode > 0) {
+    printf("Vocab size: %lld\n", vocab_size);
+    printf("ngram size: %lld\n", ngram_size);
+    printf("Words in train file: %lld\n", total_words);
+  }
+}
+
+void SaveVocab() {
+  long long i;
+  FILE *fo = fopen(save_vocab_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot create vocabulary %s\n", save_vocab_file);
+    exit(1);
+  }
+  if (vocab_binary) SaveVocabBinary(fo);
+  else for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", VocabWord(i), ngram_infos[i].cn);
+  fclose(fo);
+}
+
+// Reads a vocabulary of words and counts, or maps one saved with -vocab-binary 1
+void ReadVocab() {
+  long long a;
+  char c;
+  char word[MAX_STRING], magic[8];
+  FILE *fin = fopen(read_vocab_file, "rb");
+  if (fin == NULL) {
+    printf("Vocabulary file not found\n");
+    exit(1);
+  }
+  if (fread(magic, 1, 8, fin) == 8 && !memcmp(magic, "NG2VVOCB", 8)) {
+    fclose(fin);
+    MapVocab();
+    return;
+  }
+  rewind(fin);
+  ngram_size = 0;
+  vocab_size = 0;
+  while (1) {
+    ReadWord(word, fin);
+    if (feof(fin)) break;
+    a = AddWordToVocab(word);
+    fscanf(fin, "%lld%c", &ngram_infos[a].cn, &c);
+  }
+  fclose(fin);
+  SortNgram();
+  if (debug_mode > 0) {
+    printf("Vocab size: %lld\n", vocab_size);
+  }
+}
+
+// Returns a hash of the vocabulary, used to tell whether a corpus cache was encoded with it
+long long VocabFingerprint() {
+  long long a;
+  unsigned long long hash = 14695981039346656037ULL;
+  char *p;
+  for (a = 0; a < vocab_size; a++) {
+    for (p = VocabWord(a); *p; p++) hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+    hash = (hash ^ ngram_infos[a].cn) * 1099511628211ULL;
+  }
+  for (a = vocab_size * ngrams; a < ngram_size * ngrams; a++) hash = (hash ^ ngram_words[a]) * 1099511628211ULL;
+  if (buckets > 0) hash = (hash ^ buckets) * 1099511628211ULL;
+  return hash ^ ngrams;
+}
+
+// Writes the training file as records of ngram ids, so the training threads never see text.
+// With -buckets, an ngram of known words that is not in the vocabulary gets the id of its bucket
+void EncodeTrainFile(FILE *fo) {
+  char *word;
+  int rec[MAX_NGRAM], wids[MAX_NGRAM];
+  int n, len;
+  unsigned long long hash;
+  long long positions = 0, words_encoded = 0, sentence_words = 0, text_size = 0, released = 0;
+  struct cache_header header;
+  struct token_reader tr;
+  // The mapped training file, or the block of file 'file' of the text pipeline
+  char *text = NULL, *block = NULL;
+  int file = 0;
+  if (text_pipeline) StartTextPipeline();
+  else text = MapFile(text_files[0].name, &text_size);
+  tr.pos = text;
+  tr.end = text + text_size;
+  memset(&header, 0, sizeof(header));
+  fwrite(&header, sizeof(header), 1, fo);
+  unsigned long long t = 0;
+  int sampled;
+  rec[0] = CACHE_EOS;
+  while (1) {
+    sampled = profile && words_encoded % PROFILE_SAMPLE == 0;
+    if (sampled) t = Cycles();
+    word = ReadToken(&tr, &len);
+    if (sampled) encode_cycles[CYCLES_TOKENIZE] += Cycles() - t;
+    if (word == NULL && text_pipeline) {
+      // The blocks end at line ends, so no sentence goes on in the next one
+      free(block);
+      while (file < text_file_count && (block = TakeTextBlock(file, &text_size)) == NULL) file++;
+      if (block != NULL) {
+        tr.pos = block;
+        tr.end = block + text_size;
+        continue;
+      }
+    }
+    if (word == NULL || (len == 4 && !memcmp(word, "</s>", 4))) {
+      if (sentence_words > 0) {
+        rec[0] = CACHE_EOS;
+        for (n = 1; n < ngrams; ++n) rec[n] = -1;
+        fwrite(rec, sizeof(int), ngrams, fo);
+        positions++;
+      }
+      sentence_words = 0;
+      if (word == NULL) break;
+      continue;
+    }
+    if (sampled) t = Cycles();
+    for (n = 0; n + 1 < ngrams; n++) wids[n] = wids[n + 1];
+    wids[ngrams - 1] = SearchVocab(word, len);
+    sentence_words++;
+    words_encoded++;
+    rec[0] = wids[ngrams - 1];
+    for (n = 2; n <= ngrams; n++) rec[n - 1] = -1;
+    hash = wids[ngrams - 1] + 1;
+    for (n = 2; n <= ngrams && n <= sentence_words; n++) {
+      // Ngrams with a word that is not in the vocabulary are not either
+      if (wids[ngrams - 1] == -1 || wids[ngrams - n] == -1) break;
+      hash = hash * NGRAM_HASH_MUL + wids[ngrams - n] + 1;
+      rec[n - 1] = SearchNgram(wids + ngrams - n, n, hash);
+      if (rec[n - 1] == -1 && buckets > 0) rec[n - 1] = ngram_size + HashSlot(hash, buckets);
+    }
+    if (sampled) encode_cycles[CYCLES_LOOKUP] += Cycles() - t;
+    fwrite(rec, sizeof(int), ngrams, fo);
+    positions++;
+    if (positions % 100000 == 0 && !text_pipeline) {
+      ReleasePages(text, released, tr.pos - text);
+      released = tr.pos - text;
+    }
+    if ((debug_mode > 1) && (positions % 100000 == 0)) {
+      printf("Encoding: %lldK%c", positions / 1000, 13);
+      fflush(stdout);
+    }
+  }
+  if (text_pipeline) StopTextPipeline();
+  else if (text != NULL) munmap(text, text_size);
+  memcpy(header.magic, "NG2VCACH", 8);
+  header.version = CACHE_VERSION;
+  header.ngrams = ngrams;
+  header.ngram_size = ngram_size;
+  header.total_words = words_encoded;
+  header.positions = positions;
+  header.fingerprint = VocabFingerprint();
+  fseek(fo, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fo);
+  fflush(fo);
+}
+
+// Returns 1 if the file holds a cache encoded with the current vocabulary
+int CacheIsValid(int fd) {
+  struct cache_header header;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (long long)sizeof(header)) return 0;
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header)) return 0;
+  if (memcmp(header.magic, "NG2VCACH", 8) || header.version != CACHE_VERSION) return 0;
+  if (header.ngrams != ngrams || header.ngram_size != ngram_size) return 0;
+  if (header.fingerprint != VocabFingerprint()) return 0;
+  if (st.st_size != (long long)sizeof(header) + header.positions * ngrams * (long long)sizeof(int)) return 0;
+  return 1;
+}
+
+// Maps the corpus cache into memory, encoding the training file first unless -cache names a valid one.
+// Without -cache the encoded corpus goes to an anonymous temporary file
+void LoadCorpusCache() {
+  FILE *fo = NULL;
+  int fd = -1;
+  struct cache_header *header;
+  if (cache_file[0] != 0) {
+    fd = open(cache_file, O_RDONLY);
+    if (fd >= 0 && !CacheIsValid(fd)) {
+      close(fd);
+      fd = -1;
+    }
+    if (fd >= 0) {
+      if (debug_mode > 0) printf("Reusing corpus cache %s\n", cache_file);
+    } else {
+      fo = fopen(cache_file, "w+b");
+      if (fo == NULL) {
+        printf("ERROR: cannot create corpus cache %s\n", cache_file);
+        exit(1);
+      }
+    }
+  } else {
+    fo = tmpfile();
+    if (fo == NULL) {
+      printf("ERROR: cannot create a temporary corpus cache\n");
+      exit(1);
+    }
+  }
+  if (fo != NULL) {
+    EncodeTrainFile(fo);
+    fd = dup(fileno(fo));
+    fclose(fo);
+  }
+  corpus_map_size = lseek(fd, 0, SEEK_END);
+  corpus_map = mmap(NULL, corpus_map_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (corpus_map == MAP_FAILED) {
+    printf("ERROR: cannot map the corpus cache\n");
+    exit(1);
+  }
+  header = (struct cache_header *)corpus_map;
+  corpus = (int *)(header + 1);
+  corpus_positions = header->positions;
+  total_words = header->total_words;
+  madvise(corpus_map, corpus_map_size, MADV_SEQUENTIAL);
+  if (debug_mode > 0) printf("Corpus cache: %lld positions\n", corpus_positions);
+}
+
+// Returns the first position at or after pos that starts a sentence
+long long SentenceStart(long long pos) {
+  if (pos <= 0) return 0;
+  while (pos < corpus_positions && corpus[(pos - 1) * ngrams] != CACHE_EOS) pos++;
+  return pos;
+}
+
+// Kernels of the training loop. InitKernels points them at the widest instruction set the host
+// CPU supports, so one binary runs everywhere. All variants compute the same sums, only the
+// order of the additions (and with FMA the rounding) differs
+real (*Dot)(real *x, real *y, long long n);                          // Returns x . y
+void (*Axpy)(real *y, real a, real *x, long long n);                 // y += a * x
+void (*Update)(real *e, real *w, real *x, real g, long long n);      // e += g * w, then w += g * x
+void (*Sigmoid)(real *f, int n);                                     // f = 1 / (1 + exp(-f))
+// Conversions of the rows of -storage f16 or bf16. StoreHalf rounds stochastically: up or down
+// with the probabilities that make the stored value right on average, so that updates smaller
+// than the spacing of the 16-bit numbers are not all lost
+void (*LoadHalf)(real *x, unsigned short *h, long long n);                                   // x = h
+void (*StoreHalf)(unsigned short *h, real *x, long long n, unsigned long long *next_random);   // h = x
+
+real DotScalar(real *x, real *y, long long n) {
+  long long c;
+  real f = 0;
+  for (c = 0; c < n; c++) f += x[c] * y[c];
+  return f;
+}
+
+void AxpyScalar(real *y, real a, real *x, long long n) {
+  long long c;
+  for (c = 0; c < n; c++) y[c] += a * x[c];
+}
+
+void UpdateScalar(real *e, real *w, real *x, real g, long long n) {
+  long long c;
+  for (c = 0; c < n; c++) {
+    e[c] += g * w[c];
+    w[c] += g * x[c];
+  }
+}
+
+// Adds to x a uniform fraction of the spacing of the half precision numbers around it, away from
+// zero, so that truncating the sum rounds x stochastically. Below 2^-14 the spacing is that of
+// the subnormals, 2^-24
+float DitherHalf(float x, unsigned long long *next_random) {
+  unsigned int bits, e;
+  float ulp;
+  memcpy(&bits, &x, 4);
+  e = (bits >> 23) & 0xff;
+  if (e < 127 - 14) e = 127 - 14;
+  bits = (e - 10) << 23;
+  memcpy(&ulp, &bits, 4);
+  *next_random = *next_random * (unsigned long long)25214903917 + 11;
+  return x + copysignf((*next_random >> 24 & 0xFFFFFF) / 16777216.0f * ulp, x);
+}
+
+// Half precision, rounded toward zero; large numbers become the largest finite one
+unsigned short HalfTowardZero(float f) {
+  unsigned int x, sign, mant;
+  int exp;
+  memcpy(&x, &f, 4);
+  sign = (x >> 16) & 0x8000;
+  exp = (int)((x >> 23) & 0xff) - 127 + 15;
+  mant = x & 0x7fffff;
+  if (exp >= 31) return sign | 0x7bff;
+  if (exp <= 0) return exp < -10 ? sign : sign | ((mant | 0x800000) >> (14 - exp));
+  return sign | (exp << 10) | (mant >> 13);
+}
+
+void LoadF16Scalar(real *x, unsigned short *h, long long n) {
+  long long c;
+  for (c = 0; c < n; c++) x[c] = HalfToFloat(h[c]);
+}
+
+void StoreF16Scalar(unsigned short *h, real *x, long long n, unsigned long long *next_random) {
+  long long c;
+  for (c = 0; c < n; c++) h[c] = HalfTowardZero(DitherHalf(x[c], next_random));
+}
+
+// bfloat16 is the upper half of a float, so a random lower half added before truncating rounds
+// it stochastically
+void LoadBf16Scalar(real *x, unsigned short *h, long long n) {
+  unsigned int bits;
+  long long c;
+  for (c = 0; c < n; c++) {
+    bits = (unsigned int)h[c] << 16;
+    memcpy(&x[c], &bits, 4);
+  }
+}
+
+void StoreBf16Scalar(unsigned short *h, real *x, long long n, unsigned long long *next_random) {
+  unsigned int bits;
+  long long c;
+  for (c = 0; c < n; c++) {
+    memcpy(&bits, &x[c], 4);
+    *next_random = *next_random * (unsigned long long)25214903917 + 11;
+    h[c] = (bits + (unsigned int)(*next_random >> 16 & 0xFFFF)) >> 16;
+  }
+}
+
+// exp(x) as 2^k * exp(r) with |r| <= ln(2) / 2 and a polynomial for exp(r); the vector kernels
+// use the same steps
+real ExpScalar(real x) {
+  real k, r, p;
+  union {float f; int i;} u;
+  if (x > 88.3f) x = 88.3f;
+  if (x < -87.3f) x = -87.3f;
+  k = floorf(x * 1.44269504f + 0.5f);
+  r = x - k * 0.693359375f + k * 2.12194440e-4f;
+  p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  p = p * r * r + r + 1;
+  u.i = ((int)k + 127) << 23;
+  return p * u.f;
+}
+
+void SigmoidScalar(real *f, int n) {
+  int d;
+  for (d = 0; d < n; d++) f[d] = 1 / (1 + ExpScalar(-f[d]));
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+real DotSse2(real *x, real *y, long long n) {
+  __m128 s = _mm_setzero_ps();
+  float t[4];
+  long long c;
+  for (c = 0; c + 4 <= n; c += 4) s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(x + c), _mm_loadu_ps(y + c)));
+  _mm_storeu_ps(t, s);
+  t[0] += t[1] + t[2] + t[3];
+  for (; c < n; c++) t[0] += x[c] * y[c];
+  return t[0];
+}
+
+void AxpySse2(real *y, real a, real *x, long long n) {
+  __m128 va = _mm_set1_ps(a);
+  long long c;
+  for (c = 0; c + 4 <= n; c += 4) _mm_storeu_ps(y + c, _mm_add_ps(_mm_loadu_ps(y + c), _mm_mul_ps(va, _mm_loadu_ps(x + c))));
+  for (; c < n; c++) y[c] += a * x[c];
+}
+
+void UpdateSse2(real *e, real *w, real *x, real g, long long n) {
+  __m128 vg = _mm_set1_ps(g), vw;
+  long long c;
+  for (c = 0; c + 4 <= n; c += 4) {
+    vw = _mm_loadu_ps(w + c);
+    _mm_storeu_ps(e + c, _mm_add_ps(_mm_loadu_ps(e + c), _mm_mul_ps(vg, vw)));
+    _mm_storeu_ps(w + c, _mm_add_ps(vw, _mm_mul_ps(vg, _mm_loadu_ps(x + c))));
+  }
+  for (; c < n; c++) {
+    e[c] += g * w[c];
+    w[c] += g * x[c];
+  }
+}
+
+__attribute__((target("avx2,fma"))) real DotAvx2(real *x, real *y, long long n) {
+  __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+  __m128 s;
+  long long c;
+  real f;
+  for (c = 0; c + 16 <= n; c += 16) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c), _mm256_loadu_ps(y + c), s0);
+    s1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c + 8), _mm256_loadu_ps(y + c + 8), s1);
+  }
+  if (c + 8 <= n) {
+    s0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + c), _mm256_loadu_ps(y + c), s0);
+    c += 8;
+  }
+  s0 = _mm256_add_ps(s0, s1);
+  s = _mm_add_ps(_mm256_castps256_ps128(s0), _mm256_extractf128_ps(s0, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  f = _mm_cvtss_f32(s);
+  for (; c < n; c++) f += x[c] * y[c];
+  return f;
+}
+
+__attribute__((target("avx2,fma"))) void AxpyAvx2(real *y, real a, real *x, long long n) {
+  __m256 va = _mm256_set1_ps(a);
+  long long c;
+  for (c = 0; c + 8 <= n; c += 8) _mm256_storeu_ps(y + c, _mm256_fmadd_ps(va, _mm256_loadu_ps(x + c), _mm256_loadu_ps(y + c)));
+  for (; c < n; c++) y[c] += a * x[c];
+}
+
+__attribute__((target("avx2,fma"))) void UpdateAvx2(real *e, real *w, real *x, real g, long long n) {
+  __m256 vg = _mm256_set1_ps(g), vw;
+  long long c;
+  for (c = 0; c + 8 <= n; c += 8) {
+    vw = _mm256_loadu_ps(w + c);
+    _mm256_storeu_ps(e + c, _mm256_fmadd_ps(vg, vw, _mm256_loadu_ps(e + c)));
+    _mm256_storeu_ps(w + c, _mm256_fmadd_ps(vg, _mm256_loadu_ps(x + c), vw));
+  }
+  for (; c < n; c++) {
+    e[c] += g * w[c];
+    w[c] += g * x[c];
+  }
+}
+
+// The random bits of the vector conversions: a xorshift generator per lane, seeded from
+// next_random, which moves on once per row
+__attribute__((target("avx2"))) __m256i SeedAvx2(unsigned long long *next_random) {
+  unsigned int s;
+  *next_random = *next_random * (unsigned long long)25214903917 + 11;
+  s = (unsigned int)(*next_random >> 16) | 1;
+  return _mm256_mullo_epi32(_mm256_set1_epi32(s), _mm256_setr_epi32(0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F,
+                                                                       0x165667B1, 0xD3A2646D, 0xFD7046C5, 0xB55A4F09));
+}
+
+__attribute__((target("avx2"))) __m256i XorshiftAvx2(__m256i r) {
+  r = _mm256_xor_si256(r, _mm256_slli_epi32(r, 13));
+  r = _mm256_xor_si256(r, _mm256_srli_epi32(r, 17));
+  return _mm256_xor_si256(r, _mm256_slli_epi32(r, 5));
+}
+
+// The 16-bit kernels convert a partial last vector through padded copies, like SigmoidAvx2
+__attribute__((target("avx2,f16c"))) void LoadF16Avx2(real *x, unsigned short *h, long long n) {
+  unsigned short th[8] = {0};
+  float tx[8];
+  long long c;
+  for (c = 0; c + 8 <= n; c += 8) _mm256_storeu_ps(x + c, _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)(h + c))));
+  if (c == n) return;
+  memcpy(th, h + c, (n - c) * sizeof(unsigned short));
+  _mm256_storeu_ps(tx, _mm256_cvtph_ps(_mm_loadu_si128((__m128i *)th)));
+  memcpy(x + c, tx, (n - c) * sizeof(float));
+}
+
+// As DitherHalf and HalfTowardZero, eight at a time
+__attribute__((target("avx2,f16c"))) void StoreF16Avx2(unsigned short *h, real *x, long long n, unsigned long long *next_random) {
+  __m256i r = SeedAvx2(next_random), e;
+  __m256 v, u;
+  unsigned short th[8];
+  float tx[8] = {0};
+  long long c;
+  for (c = 0; c < n; c += 8) {
+    if (c + 8 > n) {
+      memcpy(tx, x + c, (n - c) * sizeof(float));
+      v = _mm256_loadu_ps(tx);
+    } else v = _mm256_loadu_ps(x + c);
+    e = _mm256_and_si256(_mm256_castps_si256(v), _mm256_set1_epi32(0x7f800000));
+    e = _mm256_sub_epi32(_mm256_max_epi32(e, _mm256_set1_epi32((127 - 14) << 23)), _mm256_set1_epi32(10 << 23));
+    r = XorshiftAvx2(r);
+    u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(r, 8)), _mm256_set1_ps(1.0f / 16777216));
+    u = _mm256_or_ps(_mm256_mul_ps(u, _mm256_castsi256_ps(e)), _mm256_and_ps(v, _mm256_set1_ps(-0.0f)));
+    if (c + 8 > n) {
+      _mm_storeu_si128((__m128i *)th, _mm256_cvtps_ph(_mm256_add_ps(v, u), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+      memcpy(h + c, th, (n - c) * sizeof(unsigned short));
+    } else _mm_storeu_si128((__m128i *)(h + c), _mm256_cvtps_ph(_mm256_add_ps(v, u), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC));
+  }
+}
+
+__attribute__((target("avx2"))) void LoadBf16Avx2(real *x, unsigned short *h, long long n) {
+  unsigned short th[8] = {0};
+  float tx[8];
+  long long c;
+  for (c = 0; c < n; c += 8) {
+    if (c + 8 > n) {
+      memcpy(th, h + c, (n - c) * sizeof(unsigned short));
+      _mm256_storeu_ps(tx, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)th)), 16)));
+      memcpy(x + c, tx, (n - c) * sizeof(float));
+    } else _mm256_storeu_ps(x + c, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((__m128i *)(h + c))), 16)));
+  }
+}
+
+__attribute__((target("avx2"))) void StoreBf16Avx2(unsigned short *h, real *x, long long n, unsigned long long *next_random) {
+  __m256i r = SeedAvx2(next_random), v;
+  unsigned short th[8];
+  float tx[8] = {0};
+  long long c;
+  for (c = 0; c < n; c += 8) {
+    if (c + 8 > n) {
+      memcpy(tx, x + c, (n - c) * sizeof(float));
+      v = _mm256_castps_si256(_mm256_loadu_ps(tx));
+    } else v = _mm256_castps_si256(_mm256_loadu_ps(x + c));
+    r = XorshiftAvx2(r);
+    v = _mm256_srli_epi32(_mm256_add_epi32(v, _mm256_srli_epi32(r, 16)), 16);
+    // Packing with unsigned saturation keeps the 16-bit values, which are all below 65536
+    v = _mm256_permute4x64_epi64(_mm256_packus_epi32(v, v), 0x08);
+    if (c + 8 > n) {
+      _mm_storeu_si128((__m128i *)th, _mm256_castsi256_si128(v));
+      memcpy(h + c, th, (n - c) * sizeof(unsigned short));
+    } else _mm_storeu_si128((__m128i *)(h + c), _mm256_castsi256_si128(v));
+  }
+}
+
+__attribute__((target("avx2,fma"))) void SigmoidAvx2(real *f, int n) {
+  __m256 x, k, r, p;
+  float tail[8];
+  int d;
+  for (d = 0; d < n; d += 8) {
+    // A partial last vector goes through a padded copy, as batches are often shorter than 8
+    if (d + 8 > n) {
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, f + d, (n - d) * sizeof(float));
+      x = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(tail));
+    } else x = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(f + d));
+    x = _mm256_max_ps(_mm256_min_ps(x, _mm256_set1_ps(88.3f)), _mm256_set1_ps(-87.3f));
+    k = _mm256_floor_ps(_mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504f), _mm256_set1_ps(0.5f)));
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(0.693359375f), x);
+    r = _mm256_fmadd_ps(k, _mm256_set1_ps(2.12194440e-4f), r);
+    p = _mm256_set1_ps(1.9875691500e-4f);
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+    p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+    p = _mm256_add_ps(_mm256_fmadd_ps(_mm256_mul_ps(p, r), r, r), _mm256_set1_ps(1));
+    k = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(k), _mm256_set1_epi32(127)), 23));
+    p = _mm256_add_ps(_mm256_mul_ps(p, k), _mm256_set1_ps(1));
+    p = _mm256_div_ps(_mm256_set1_ps(1), p);
+    if (d + 8 > n) {
+      _mm256_storeu_ps(tail, p);
+      memcpy(f + d, tail, (n - d) * sizeof(float));
+    } else _mm256_storeu_ps(f + d, p);
+  }
+}
+
+__attribute__((target("avx512f"))) real DotAvx512(real *x, real *y, long long n) {
+  __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+  __mmask16 m;
+  long long c;
+  for (c = 0; c + 32 <= n; c += 32) {
+    s0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + c), _mm512_loadu_ps(y + c), s0);
+    s1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + c + 16), _mm512_loadu_ps(y + c + 16), s1);
+  }
+  // The last partial vectors are loaded with a mask, so there is no scalar tail
+  for (; c < n; c += 16) {
+    m = n - c >= 16 ? 0xFFFF : (1 << (n - c)) - 1;
+    s0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(m, x + c), _mm512_maskz_loadu_ps(m, y + c), s0);
+  }
+  return _mm512_reduce_add_ps(_mm512_add_ps(s0, s1));
+}
+
+__attribute__((target("avx512f"))) void AxpyAvx512(real *y, real a, real *x, long long n) {
+  __m512 va = _mm512_set1_ps(a);
+  __mmask16 m;
+  long long c;
+  for (c = 0; c < n; c += 16) {
+    m = n - c >= 16 ? 0xFFFF : (1 << (n - c)) - 1;
+    _mm512_mask_storeu_ps(y + c, m, _mm512_fmadd_ps(va, _mm512_maskz_loadu_ps(m, x + c), _mm512_maskz_loadu_ps(m, y + c)));
+  }
+}
+
+__attribute__((target("avx512f"))) void UpdateAvx512(real *e, real *w, real *x, real g, long long n) {
+  __m512 vg = _mm512_set1_ps(g), vw;
+  __mmask16 m;
+  long long c;
+  for (c = 0; c < n; c += 16) {
+    m = n - c >= 16 ? 0xFFFF : (1 << (n - c)) - 1;
+    vw = _mm512_maskz_loadu_ps(m, w + c);
+    _mm512_mask_storeu_ps(e + c, m, _mm512_fmadd_ps(vg, vw, _mm512_maskz_loadu_ps(m, e + c)));
+    _mm512_mask_storeu_ps(w + c, m, _mm512_fmadd_ps(vg, _mm512_maskz_loadu_ps(m, x + c), vw));
+  }
+}
+
+__attribute__((target("avx512f"))) __m512i SeedAvx512(unsigned long long *next_random) {
+  unsigned int s;
+  *next_random = *next_random * (unsigned long long)25214903917 + 11;
+  s = (unsigned int)(*next_random >> 16) | 1;
+  return _mm512_mullo_epi32(_mm512_set1_epi32(s), _mm512_setr_epi32(0x9E3779B1, 0x85EBCA77, 0xC2B2AE3D, 0x27D4EB2F,
+                                                                       0x165667B1, 0xD3A2646D, 0xFD7046C5, 0xB55A4F09,
+                                                                       0x8CB92BA7, 0xE7037ED1, 0xAF251AF3, 0x94D049BB,
+                                                                       0xBF58476D, 0xDB4F0B91, 0xA0761D65, 0xC6A4A793));
+}
+
+__attribute__((target("avx512f"))) __m512i XorshiftAvx512(__m512i r) {
+  r = _mm512_xor_si512(r, _mm512_slli_epi32(r, 13));
+  r = _mm512_xor_si512(r, _mm512_srli_epi32(r, 17));
+  return _mm512_xor_si512(r, _mm512_slli_epi32(r, 5));
+}
+
+// The 16-bit values of a partial last vector are loaded and stored through padded copies, as
+// masked 16-bit moves need AVX-512BW
+__attribute__((target("avx512f"))) void LoadF16Avx512(real *x, unsigned short *h, long long n) {
+  unsigned short th[16] = {0};
+  __mmask16 m;
+  long long c;
+  for (c = 0; c < n; c += 16) {
+    if (c + 16 > n) {
+      m = (1 << (n - c)) - 1;
+      memcpy(th, h + c, (n - c) * sizeof(unsigned short));
+      _mm512_mask_storeu_ps(x + c, m, _mm512_cvtph_ps(_mm256_loadu_si256((__m256i *)th)));
+    } else _mm512_storeu_ps(x + c, _mm512_cvtph_ps(_mm256_loadu_si256((__m256i *)(h + c))));
+  }
+}
+
+__attribute__((target("avx512f"))) void StoreF16Avx512(unsigned short *h, real *x, long long n, unsigned long long *next_random) {
+  __m512i r = SeedAvx512(next_random), e;
+  __m512 v, u;
+  __m256i p;
+  unsigned short th[16];
+  __mmask16 m;
+  long long c;
+  for (c = 0; c < n; c += 16) {
+    m = n - c >= 16 ? 0xFFFF : (1 << (n - c)) - 1;
+    v = _mm512_maskz_loadu_ps(m, x + c);
+    e = _mm512_and_si512(_mm512_castps_si512(v), _mm512_set1_epi32(0x7f800000));
+    e = _mm512_sub_epi32(_mm512_max_epi32(e, _mm512_set1_epi32((127 - 14) << 23)), _mm512_set1_epi32(10 << 23));
+    r = XorshiftAvx512(r);
+    u = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_srli_epi32(r, 8)), _mm512_set1_ps(1.0f / 16777216));
+    u = _mm512_mul_ps(u, _mm512_castsi512_ps(e));
+    u = _mm512_castsi512_ps(_mm512_or_si512(_mm512_castps_si512(u), _mm512_and_si512(_mm512_castps_si512(v), _mm512_set1_epi32(0x80000000))));
+    p = _mm512_cvt_roundps_ph(_mm512_add_ps(v, u), _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    if (m != 0xFFFF) {
+      _mm256_storeu_si256((__m256i *)th, p);
+      memcpy(h + c, th, (n - c) * sizeof(unsigned short));
+    } else _mm256_storeu_si256((__m256i *)(h + c), p);
+  }
+}
+
+__attribute__((target("avx512f"))) void LoadBf16Avx512(real *x, unsigned short *h, long long n) {
+  unsigned short th[16] = {0};
+  __mmask16 m;
+  long long c;
+  for (c = 0; c < n; c += 16) {
+    if (c + 16 > n) {
+      m = (1 << (n - c)) - 1;
+      memcpy(th, h + c, (n - c) * sizeof(unsigned short));
+      _mm512_mask_storeu_ps(x + c, m, _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *)th)), 16)));
+    } else _mm512_storeu_ps(x + c, _mm512_castsi512_ps(_mm512_slli_epi32(_mm512_cvtepu16_epi32(_mm256_loadu_si256((__m256i *)(h + c))), 16)));
+  }
+}
+
+__attribute__((target("avx512f"))) void StoreBf16Avx512(unsigned short *h, real *x, long long n, unsigned long long *next_random) {
+  __m512i r = SeedAvx512(next_random), v;
+  __m256i p;
+  unsigned short th[16];
+  __mmask16 m;
+  long long c;
+  for (c = 0; c < n; c += 16) {
+    m = n - c >= 16 ? 0xFFFF : (1 << (n - c)) - 1;
+    r = XorshiftAvx512(r);
+    v = _mm512_add_epi32(_mm512_castps_si512(_mm512_maskz_loadu_ps(m, x + c)), _mm512_srli_epi32(r, 16));
+    p = _mm512_cvtepi32_epi16(_mm512_srli_epi32(v, 16));
+    if (m != 0xFFFF) {
+      _mm256_storeu_si256((__m256i *)th, p);
+      memcpy(h + c, th, (n - c) * sizeof(unsigned short));
+    } else _mm256_storeu_si256((__m256i *)(h + c), p);
+  }
+}
+#endif
+
+// Points the kernels at the variant given by name, or at the best one the CPU supports for "auto"
+void InitKernels(char *name) {
+  int avx2 = 0, avx512 = 0, sse2 = 0;
+  Dot = DotScalar;
+  Axpy = AxpyScalar;
+  Update = UpdateScalar;
+  Sigmoid = SigmoidScalar;
+  LoadHalf = storage == STORAGE_BF16 ? LoadBf16Scalar : LoadF16Scalar;
+  StoreHalf = storage == STORAGE_BF16 ? StoreBf16Scalar : StoreF16Scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  // The vector kernels work on floats
+  if (sizeof(real) == sizeof(float)) {
+    sse2 = __builtin_cpu_supports("sse2");
+    avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    avx512 = avx2 && __builtin_cpu_supports("avx512f");
+  }
+#endif
+  if (!strcmp(name, "auto")) {
+    if (avx512) strcpy(name, "avx512");
+    else if (avx2) strcpy(name, "avx2");
+    else if (sse2) strcpy(name, "sse2");
+    else strcpy(name, "scalar");
+  }
+  if (strcmp(name, "scalar") && strcmp(name, "sse2") && strcmp(name, "avx2") && strcmp(name, "avx512")) {
+    printf("ERROR: unknown kernel %s\n", name);
+    exit(1);
+  }
+  if ((!strcmp(name, "sse2") && !sse2) || (!strcmp(name, "avx2") && !avx2) || (!strcmp(name, "avx512") && !avx512)) {
+    printf("ERROR: this CPU does not support the %s kernel\n", name);
+    exit(1);
+  }
+#if defined(__x86_64__) || defined(__i386__)
+  if (!strcmp(name, "sse2")) {
+    Dot = DotSse2;
+    Axpy = AxpySse2;
+    Update = UpdateSse2;
+  }
+  if (!strcmp(name, "avx2") || !strcmp(name, "avx512")) {
+    Dot = DotAvx2;
+    Axpy = AxpyAvx2;
+    Update = UpdateAvx2;
+    Sigmoid = SigmoidAvx2;
+    if (storage == STORAGE_BF16) {
+      LoadHalf = LoadBf16Avx2;
+      StoreHalf = StoreBf16Avx2;
+    } else if (__builtin_cpu_supports("f16c")) {
+      LoadHalf = LoadF16Avx2;
+      StoreHalf = StoreF16Avx2;
+    }
+  }
+  if (!strcmp(name, "avx512")) {
+    Dot = DotAvx512;
+    Axpy = AxpyAvx512;
+    Update = UpdateAvx512;
+    LoadHalf = storage == STORAGE_BF16 ? LoadBf16Avx512 : LoadF16Avx512;
+    StoreHalf = storage == STORAGE_BF16 ? StoreBf16Avx512 : StoreF16Avx512;
+  }
+#endif
+}
+
+// Sets s[d] to the sigmoid of f[d] for the f[d] in [-MAX_EXP, MAX_EXP], looked up in expTable or
+// computed by the Sigmoid kernel with -sigmoid 1
+void Activate(real *f, real *s, int n) {
+  int d;
+  if (compute_sigmoid) {
+    memcpy(s, f, n * sizeof(real));
+    Sigmoid(s, n);
+    return;
+  }
+  for (d = 0; d < n; d++) if (f[d] >= -MAX_EXP && f[d] <= MAX_EXP) s[d] = expTable[(int)((f[d] + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+}
+
+// Returns the thread's copy of row r if it is one of its hot rows, or else NULL
+real *HotRow(struct hot_rows *hot, long long r) {
+  if (hot != NULL && r >= hot->begin && r < hot->end) return hot->local + (r - hot->begin) * layer1_size;
+  return NULL;
+}
+
+// Returns row r of an output matrix, from the thread's copy if it is one of its hot rows
+real *OutputRow(real *out, struct hot_rows *hot, long long r) {
+  real *row = HotRow(hot, r);
+  return row != NULL ? row : out + r * layer1_size;
+}
+
+// Trains the input vector 'in' against n rows of an output matrix, with the given labels and
+// learning rate, and adds the error of 'in' to neu1e. The dots with all rows are taken before any row is updated; as the
+// rows differ and 'in' only changes later, this is the same as one row at a time. With 'skip'
+// (hierarchical softmax) rows whose dot is outside (-MAX_EXP, MAX_EXP) are not trained, otherwise
+// (negative sampling) the sigmoid saturates there. 'hot' may be NULL
+void TrainOutputs(real *in, real *out, struct hot_rows *hot, int *rows, real *labels, int n, int skip, real *neu1e, real *f, real *s,
+                  real rate) {
+  int d;
+  real g;
+  for (d = 0; d < n; d++) f[d] = Dot(in, OutputRow(out, hot, rows[d]), layer1_size);
+  Activate(f, s, n);
+  for (d = 0; d < n; d++) {
+    if (f[d] <= -MAX_EXP || f[d] >= MAX_EXP) {
+      if (skip) continue;
+      // 'g' is the gradient multiplied by the learning rate
+      g = (labels[d] - (f[d] > 0)) * rate;
+    } else g = (labels[d] - s[d]) * rate;
+    // Propagate errors output -> hidden, and learn weights hidden -> output
+    Update(neu1e, OutputRow(out, hot, rows[d]), in, g, layer1_size);
+  }
+}
+
+// Returns row a of syn0 as floats: in place, or converted into buf with -storage f16 or bf16
+real *VectorRow(long long a, real *buf) {
+  if (syn0_half == NULL) return syn0 + a * layer1_size;
+  LoadHalf(buf, syn0_half + a * layer1_size, layer1_size);
+  return buf;
+}
+
+// Adds x to row r of a matrix, given as floats m or as the 16-bit half, through buf
+void AddToRow(real *m, unsigned short *half, long long r, real *x, real *buf, unsigned long long *next_random) {
+  if (half == NULL) {
+    Axpy(m + r * layer1_size, 1, x, layer1_size);
+    return;
+  }
+  LoadHalf(buf, half + r * layer1_size, layer1_size);
+  Axpy(buf, 1, x, layer1_size);
+  StoreHalf(half + r * layer1_size, buf, layer1_size, next_random);
+}
+
+// TrainOutputs against n different rows of syn1neg. With -storage-outputs they are converted into
+// 'block' and stored back when trained; hot rows are copied instead, as the thread keeps them as floats
+void TrainNegatives(real *in, struct hot_rows *hot, int *rows, real *labels, int n, real *neu1e, real *f, real *s, real rate,
+                    real *block, unsigned long long *next_random) {
+  int d;
+  real *row;
+  if (syn1neg_half == NULL) {
+    TrainOutputs(in, syn1neg, hot, rows, labels, n, 0, neu1e, f, s, rate);
+    return;
+  }
+  for (d = 0; d < n; d++) {
+    row = HotRow(hot, rows[d]);
+    if (row != NULL) memcpy(block + d * layer1_size, row, layer1_size * sizeof(real));
+    else LoadHalf(block + d * layer1_size, syn1neg_half + (long long)rows[d] * layer1_size, layer1_size);
+  }
+  TrainOutputs(in, block, NULL, row_order, labels, n, 0, neu1e, f, s, rate);
+  for (d = 0; d < n; d++) {
+    row = HotRow(hot, rows[d]);
+    if (row != NULL) memcpy(row, block + d * layer1_size, layer1_size * sizeof(real));
+    else StoreHalf(syn1neg_half + (long long)rows[d] * layer1_size, block + d * layer1_size, layer1_size, next_random);
+  }
+}
+
+// Computes the weights of one slice of the vocabulary for the negative sampler
+void *UnigramWeightsThread(void *id) {
+  long long a, begin = vocab_size / num_threads * (long long)id, end = vocab_size / num_threads * ((long long)id + 1);
+  if ((long long)id == num_threads - 1) end = vocab_size;
+  for (a = begin; a < end; a++) unigram_weights[a] = pow(ngram_infos[a].cn, 0.75);
+  pthread_exit(NULL);
+}
+
+// Builds the alias table of the unigram distribution raised to the power 0.75 (Vose's method).
+// It takes 8 bytes per word instead of a fixed table of 1e8 ints; the weights are computed in
+// parallel and the pairing is a single linear pass
+void InitUnigramTable() {
+  long long a, s, l, n_small = 0, n_large = 0;
+  long long *work = (long long *)malloc(vocab_size * sizeof(long long));
+  double total = 0;
+  struct alias_table *t = (struct alias_table *)malloc(sizeof(struct alias_table) + vocab_size * sizeof(struct alias_slot));
+  struct alias_slot *slot;
+  unigram_weights = (double *)malloc(vocab_size * sizeof(double));
+  if (work == NULL || t == NULL || unigram_weights == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  t->size = vocab_size;
+  slot = t->slot;
+  RunThreads(UnigramWeightsThread);
+  for (a = 0; a < vocab_size; a++) total += unigram_weights[a];
+  // Scale the weights to a mean of 1; the words below it fill 'work' from the front, the others
+  // from the back
+  for (a = 0; a < vocab_size; a++) {
+    unigram_weights[a] = unigram_weights[a] * vocab_size / total;
+    if (unigram_weights[a] < 1) work[n_small++] = a; else work[vocab_size - 1 - n_large++] = a;
+  }
+  // Each small word tops up its slot with the rest of a large one
+  while (n_small > 0 && n_large > 0) {
+    s = work[--n_small];
+    l = work[vocab_size - n_large];
+    n_large--;
+    slot[s].cut = unigram_weights[s] * (1 << 24);
+    slot[s].alias = l;
+    unigram_weights[l] -= 1 - unigram_weights[s];
+    if (unigram_weights[l] < 1) work[n_small++] = l; else work[vocab_size - 1 - n_large++] = l;
+  }
+  // What is left is 1 up to rounding
+  while (n_large > 0) {
+    l = work[vocab_size - n_large--];
+    slot[l].cut = 1 << 24;
+    slot[l].alias = l;
+  }
+  while (n_small > 0) {
+    s = work[--n_small];
+    slot[s].cut = 1 << 24;
+    slot[s].alias = s;
+  }
+  free(work);
+  free(unigram_weights);
+  // Only a complete table is published
+  __atomic_store_n(&alias_table, t, __ATOMIC_RELEASE);
+}
+
+// Draws a negative example in constant time: a uniform slot of the alias table, then the slot's
+// own word or its alias. </s> is replaced by a uniform word, as its count is not a frequency
+long long SampleNegative(unsigned long long *next_random) {
+  struct alias_table *t = __atomic_load_n(&alias_table, __ATOMIC_ACQUIRE);
+  long long slot, target;
+  *next_random = *next_random * (unsigned long long)25214903917 + 11;
+  slot = (*next_random >> 16) % t->size;
+  *next_random = *next_random * (unsigned long long)25214903917 + 11;
+  target = ((*next_random >> 24) & 0xFFFFFF) < t->slot[slot].cut ? slot : t->slot[slot].alias;
+  if (target == 0) target = *next_random % (t->size - 1) + 1;
+  return target;
+}
+
+// Data-parallel training (-workers). Every worker process trains its own copy of the model with
+// its share of the threads and of the chunks; the model they share is in memory that all of them
+// map. Before a thread changes a row of syn0 (m = 0), syn1 (1) or syn1neg (2) it marks it with
+// TouchRow, and every -sync-words words the sync thread of the worker adds to the shared row what
+// the marked rows have learned since the last sync. The next TouchRow of a row then takes in what
+// the other workers have added to it meanwhile, so only the rows a worker uses are exchanged.
+// sync_base holds every row as of its last exchange; like the rows themselves, its entries are
+// read and written without locks, Hogwild-style, but the shared rows are added to under a lock
+#define SYNC_LOCKS 4096                // Spin locks of the shared rows, by row id
+real *sync_local[3], *sync_shared[3], *sync_base[3];
+char *sync_state[3];                   // Per row: 0 = not used yet, 1 = synced, 2 = changed since, 3 = being taken in
+long long sync_rows[3];
+int *sync_locks;
+long long *worker_words;               // In the shared memory: the words trained by every worker
+
+// Marks row r of model m as changed, before a thread updates it. The first mark after a sync takes
+// in what the other workers have added since the row was last exchanged
+void TouchRow(int m, long long r) {
+  char old = sync_state[m][r];
+  real *l, *s, *b, x;
+  long long c;
+  if (old >= 2 || !__sync_bool_compare_and_swap(&sync_state[m][r], old, 3)) return;
+  l = sync_local[m] + r * layer1_size;
+  s = sync_shared[m] + r * layer1_size;
+  b = sync_base[m] + r * layer1_size;
+  // A row not used before is still as it was when the workers started
+  if (old == 0) for (c = 0; c < layer1_size; c++) l[c] = b[c] = s[c];
+  else for (c = 0; c < layer1_size; c++) {
+    x = s[c];
+    l[c] += x - b[c];
+    b[c] = x;
+  }
+  __atomic_store_n(&sync_state[m][r], 2, __ATOMIC_RELEASE);
+}
+
+// Trains the n context ngrams ctx of one target word against the target and a single set of
+// negatives shared by all of them (pWord2Vec-style, -shared-negatives 1). The rows are copied into
+// dense blocks, so the n x (negative + 1) dots and both gradient products run over a few KB that
+// stay in cache; the gradients are then added back to syn0 and syn1neg. 'f' and 's' hold n x
+// (negative + 1) values, 'in' and 'in_err' n rows, 'out' and 'out_err' negative + 1 rows
+void TrainSharedNegatives(int y, int *ctx, int n, unsigned long long *next_random, struct hot_rows *hot, int *rows, real *labels,
+                          real *in, real *in_err, real *out, real *out_err, real *f, real *s, real rate) {
+  long long i, j, m = 1, target;
+  real g, *row;
+  rows[0] = y;
+  labels[0] = 1;
+  for (j = 0; j < negative; j++) {
+    target = SampleNegative(next_random);
+    if (target == y) continue;
+    rows[m] = target;
+    labels[m] = 0;
+    m++;
+  }
+  for (i = 0; i < n; i++) {
+    if (syn0_half) LoadHalf(in + i * layer1_size, syn0_half + (long long)ctx[i] * layer1_size, layer1_size);
+    else memcpy(in + i * layer1_size, syn0 + (long long)ctx[i] * layer1_size, layer1_size * sizeof(real));
+  }
+  if (workers > 1) for (j = 0; j < m; j++) TouchRow(2, rows[j]);
+  for (j = 0; j < m; j++) {
+    if ((row = HotRow(hot, rows[j])) != NULL) memcpy(out + j * layer1_size, row, layer1_size * sizeof(real));
+    else if (syn1neg_half) LoadHalf(out + j * layer1_size, syn1neg_half + (long long)rows[j] * layer1_size, layer1_size);
+    else memcpy(out + j * layer1_size, syn1neg + (long long)rows[j] * layer1_size, layer1_size * sizeof(real));
+  }
+  memset(in_err, 0, n * layer1_size * sizeof(real));
+  memset(out_err, 0, m * layer1_size * sizeof(real));
+  for (i = 0; i < n; i++) for (j = 0; j < m; j++) f[i * m + j] = Dot(in + i * layer1_size, out + j * layer1_size, layer1_size);
+  Activate(f, s, n * m);
+  for (i = 0; i < n; i++) for (j = 0; j < m; j++) {
+    if (f[i * m + j] <= -MAX_EXP || f[i * m + j] >= MAX_EXP) g = (labels[j] - (f[i * m + j] > 0)) * rate;
+    else g = (labels[j] - s[i * m + j]) * rate;
+    Axpy(in_err + i * layer1_size, g, out + j * layer1_size, layer1_size);
+    Axpy(out_err + j * layer1_size, g, in + i * layer1_size, layer1_size);
+  }
+  // Adding the gradients, rather than copying the blocks back, keeps the updates of a row that
+  // occurs twice; with 16-bit storage the blocks are used to convert them
+  for (i = 0; i < n; i++) AddToRow(syn0, syn0_half, ctx[i], in_err + i * layer1_size, in + i * layer1_size, next_random);
+  for (j = 0; j < m; j++) {
+    if ((row = HotRow(hot, rows[j])) != NULL) Axpy(row, 1, out_err + j * layer1_size, layer1_size);
+    else AddToRow(syn1neg, syn1neg_half, rows[j], out_err + j * layer1_size, out + j * layer1_size, next_random);
+  }
+}
+
+// Copies the hot rows of an output matrix (syn1 or syn1neg, with its 16-bit half if any) for a
+// thread: the first hot_rows rows from 'begin', as far as 'rows'
+void InitHotRows(struct hot_rows *hot, real *m, unsigned short *half, long long begin, long long rows) {
+  long long r;
+  hot->begin = begin < 0 ? 0 : begin;
+  hot->end = hot->begin + hot_rows < rows ? hot->begin + hot_rows : rows;
+  hot->local = (real *)malloc((hot->end - hot->begin + 1) * layer1_size * sizeof(real));
+  hot->base = (real *)malloc((hot->end - hot->begin + 1) * layer1_size * sizeof(real));
+  if (hot->local == NULL || hot->base == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (r = hot->begin; r < hot->end; r++) {
+    if (half) LoadHalf(hot->local + (r - hot->begin) * layer1_size, half + r * layer1_size, layer1_size);
+    else memcpy(hot->local + (r - hot->begin) * layer1_size, m + r * layer1_size, layer1_size * sizeof(real));
+  }
+  memcpy(hot->base, hot->local, (hot->end - hot->begin) * layer1_size * sizeof(real));
+}
+
+// Adds what the hot rows of a thread learned since the last flush to the shared rows of matrix
+// 'sync' (1 = syn1, 2 = syn1neg, as for TouchRow), then copies the shared rows again so the
+// thread sees what the others learned. buf holds a row
+void FlushHotRows(struct hot_rows *hot, real *m, unsigned short *half, int sync, real *buf, unsigned long long *next_random) {
+  long long r, c;
+  real *x, *b;
+  for (r = hot->begin; r < hot->end; r++) {
+    x = hot->local + (r - hot->begin) * layer1_size;
+    b = hot->base + (r - hot->begin) * layer1_size;
+    for (c = 0; c < layer1_size; c++) b[c] = x[c] - b[c];
+    if (workers > 1) TouchRow(sync, r);
+    AddToRow(m, half, r, b, buf, next_random);
+    if (half) LoadHalf(x, half + r * layer1_size, layer1_size);
+    else memcpy(x, m + r * layer1_size, layer1_size * sizeof(real));
+    memcpy(b, x, layer1_size * sizeof(real));
+  }
+}
+
+// Splits the corpus cache into sentence-aligned chunks, about 16 per thread but no smaller than
+// 1024 positions, and gives every thread an equal run of them for every epoch
+void InitChunks() {
+  long long a, e, size = corpus_positions / num_threads / 16;
+  if (size < 1024) size = 1024;
+  if (size > 1 << 20) size = 1 << 20;
+  chunk_start = (long long *)malloc((corpus_positions / size + 2) * sizeof(long long));
+  chunk_count = 0;
+  for (a = 0; a < corpus_positions; a = SentenceStart(a + size)) chunk_start[chunk_count++] = a;
+  chunk_start[chunk_count] = corpus_positions;
+  chunk_queues = (unsigned long long *)malloc(iter * num_threads * sizeof(unsigned long long));
+  chunk_done = (char *)calloc(iter * chunk_count, sizeof(char));
+  thread_states = (struct thread_state *)calloc(num_threads, sizeof(struct thread_state));
+  if (chunk_queues == NULL || chunk_done == NULL || thread_states == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (e = 0; e < iter; e++) for (a = 0; a < num_threads; a++) {
+    chunk_queues[e * num_threads + a] = ((unsigned long long)(chunk_count * (a + 1) / num_threads) << 32) | (chunk_count * a / num_threads);
+  }
+  for (a = 0; a < num_threads; a++) {
+    thread_states[a].next_random = a;
+    thread_states[a].chunk = -1;
+  }
+}
+
+// Takes one chunk from a queue with a compare-and-swap: the owner takes the first one, a thief
+// the last one. Returns -1 if the queue is empty
+long long PopChunk(unsigned long long *queue, int steal) {
+  unsigned long long old, lo, hi;
+  while (1) {
+    old = *(volatile unsigned long long *)queue;
+    lo = old & 0xFFFFFFFF;
+    hi = old >> 32;
+    if (lo >= hi) return -1;
+    if (steal) hi--; else lo++;
+    if (__sync_bool_compare_and_swap(queue, old, (hi << 32) | lo)) return steal ? (long long)hi : (long long)lo - 1;
+  }
+}
+
+// Gives a thread its next chunk and its positions [*begin, *end): the next one of its own queue
+// for the epoch, or else one stolen from the end of another thread's queue. A thread that finds
+// an epoch exhausted goes on to the next one without waiting. Chunks that a resumed checkpoint
+// marks as done or taken are skipped. Returns 0 when all epochs are done. With -workers, a thread
+// only steals from the threads of its own process, whose queues hold the process's share
+int ClaimChunk(long long id, long long *epoch, long long *chunk, long long *begin, long long *end) {
+  long long c, t, first = num_threads * worker_id / workers, n = num_threads * (worker_id + 1) / workers - first;
+  for (; *epoch < iter; (*epoch)++) while (1) {
+    c = PopChunk(&chunk_queues[*epoch * num_threads + id], 0);
+    for (t = 1; c < 0 && t < n; t++) c = PopChunk(&chunk_queues[*epoch * num_threads + first + (id - first + t) % n], 1);
+    if (c < 0) break;
+    if (chunk_done[*epoch * chunk_count + c]) continue;
+    *chunk = c;
+    *begin = chunk_start[c];
+    *end = chunk_start[c + 1];
+    return 1;
+  }
+  return 0;
+}
+
+// Streaming (-stream). A reader thread tokenizes the training data as it arrives and writes records
+// like those of the corpus cache into blocks of STREAM_BLOCK positions, which the training threads
+// take in turn instead of chunks. Room for -max-ngrams words and ngrams of each higher order is
+// reserved up front: words have the ids below stream_ngram_base and ngrams the ids from it on, and
+// syn0 and syn1neg are mapped for all of them, so a new row never moves the others and training
+// never stops for it. Words and ngrams that are not in the vocabulary are counted in SpaceSaving
+// tables and join it once they have surely been seen -stream-min-count times; the negative sampler
+// is rebuilt every -stream-update words. Only the reader changes the vocabulary, holding
+// ingest_mutex, which a checkpoint takes to fork a consistent copy
+
+struct ngram_table stream_candidates[MAX_NGRAM + 1];   // Words and ngrams not in the vocabulary, by order
+long long stream_kept[MAX_NGRAM + 1];                  // Ngrams of each order in the vocabulary
+int *stream_records;                   // The blocks, one after another
+long long *stream_block_size;
+int stream_block_count, *stream_full, stream_full_head, stream_full_count, *stream_free, stream_free_count, stream_done;
+volatile sig_atomic_t stream_stop;     // Set by SIGINT and SIGTERM
+pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER, ingest_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t stream_cond = PTHREAD_COND_INITIALIZER;
+struct alias_table *retired_alias_tables;
+// Samplers built so far, and per training thread the count when it last entered ClaimBlock; a
+// thread between blocks draws no negatives, so a table replaced at an epoch all of them have
+// reached is unused
+long long alias_epoch, *stream_epochs;
+
+// Maps zeroed memory for the given number of rows; only the pages that are written take memory
+real *ReserveRows(long long rows) {
+  void *p = mmap(NULL, rows * layer1_size * sizeof(real), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {printf("Memory allocation failed\n"); exit(1);}
+  return (real *)p;
+}
+
+// Moves the ngrams of a sorted vocabulary, and their rows of syn0, up to the ids of -stream, and
+// builds hashes large enough for the whole reserved vocabulary
+void ExpandStreamVocab() {
+  long long a, n = ngram_size - vocab_size, full = vocab_size > stream_ngram_base;
+  for (a = 0; a <= MAX_NGRAM; a++) stream_kept[a] = 0;
+  for (a = vocab_size; a < ngram_size; a++) stream_kept[NgramOrder(ngram_words + a * ngrams)]++;
+  for (a = 2; a <= ngrams; a++) if (stream_kept[a] > max_ngrams) full = 1;
+  if (full) {
+    printf("ERROR: the vocabulary has more words or ngrams of an order than -max-ngrams allows\n");
+    exit(1);
+  }
+  memmove(ngram_infos + stream_ngram_base, ngram_infos + vocab_size, n * sizeof(struct ngram_info));
+  memmove(ngram_words + stream_ngram_base * ngrams, ngram_words + vocab_size * ngrams, n * ngrams * sizeof(int));
+  memmove(syn0 + stream_ngram_base * layer1_size, syn0 + vocab_size * layer1_size, n * layer1_size * sizeof(real));
+  ngram_size = stream_ngram_base + n;
+  ResizeVocabHash(stream_ngram_base * 2 + 1);
+  free(ngram_hash);
+  free(ngram_hash_keys);
+  ngram_hash = NULL;
+  ngram_hash_keys = NULL;
+  ngram_hash_used = 0;
+  ResizeNgramHash(max_ngrams * (ngrams - 1) * 2 + 1024);
+  for (a = stream_ngram_base; a < ngram_size; a++) AddNgramToHash(a, HashNgram(ngram_words + a * ngrams, NgramOrder(ngram_words + a * ngrams)));
+}
+
+// Moves the ngrams back down after the words, as the checkpoints and SaveVectors expect. The
+// hashes are not updated. Calls nothing but memmove, as the checkpoint process runs it
+void CompactStreamVocab() {
+  long long n = ngram_size - stream_ngram_base;
+  memmove(ngram_infos + vocab_size, ngram_infos + stream_ngram_base, n * sizeof(struct ngram_info));
+  memmove(ngram_words + vocab_size * ngrams, ngram_words + stream_ngram_base * ngrams, n * ngrams * sizeof(int));
+  memmove(syn0 + vocab_size * layer1_size, syn0 + stream_ngram_base * layer1_size, n * layer1_size * sizeof(real));
+  ngram_size = vocab_size + n;
+}
+
+// Reserves the vocabulary, the candidate tables and the blocks of -stream, after InitNet
+void InitStream() {
+  long long a;
+  struct ngram_table *t = &stream_candidates[1];
+  ngram_max_size = stream_ngram_base + max_ngrams * (ngrams - 1) + 2;
+  ngram_infos = (struct ngram_info *)realloc(ngram_infos, ngram_max_size * sizeof(struct ngram_info));
+  ngram_words = (int *)realloc(ngram_words, ngram_max_size * ngrams * sizeof(int));
+  if (ngram_infos == NULL || ngram_words == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  ExpandStreamVocab();
+  // A word candidate keeps its string in slot e of MAX_STRING bytes, see CountWord
+  InitTable(t, 1 << 16, 0, max_ngrams);
+  t->strings.size = t->strings.max_size = max_ngrams * MAX_STRING;
+  t->strings.data = (char *)malloc(t->strings.size);
+  if (t->strings.data == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 2; a <= ngrams; a++) InitTable(&stream_candidates[a], 1 << 16, 1, max_ngrams);
+  stream_block_count = num_threads * 2 + 2;
+  stream_records = (int *)malloc((long long)stream_block_count * STREAM_BLOCK * ngrams * sizeof(int));
+  stream_block_size = (long long *)calloc(stream_block_count, sizeof(long long));
+  stream_full = (int *)malloc(stream_block_count * sizeof(int));
+  stream_free = (int *)malloc(stream_block_count * sizeof(int));
+  stream_epochs = (long long *)calloc(num_threads, sizeof(long long));
+  if (stream_records == NULL || stream_block_size == NULL || stream_full == NULL || stream_free == NULL || stream_epochs == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  for (a = 0; a < stream_block_count; a++) stream_free[a] = a;
+  stream_free_count = stream_block_count;
+  corpus = stream_records;
+  // A resumed or read vocabulary can be sampled from the start
+  if (vocab_size > 1) InitUnigramTable();
+}
+
+// Gives the reader an empty block, waiting for the training threads to return one
+int TakeFreeBlock() {
+  int b;
+  pthread_mutex_lock(&stream_mutex);
+  while (stream_free_count == 0) pthread_cond_wait(&stream_cond, &stream_mutex);
+  b = stream_free[--stream_free_count];
+  pthread_mutex_unlock(&stream_mutex);
+  return b;
+}
+
+// Hands the block of the reader to the training threads and takes a new one. The negative sampler
+// is rebuilt first when it is due, so a block never has a word the sampler does not know, and the
+// replaced samplers that no thread can be using any more are freed
+void PublishBlock(int *block, long long *used) {
+  static long long sampled_words = -1;
+  struct alias_table *t = alias_table, **r, *old;
+  long long a, oldest;
+  int rebuilt = 0;
+  if (vocab_size > 1 && (t == NULL || total_words - sampled_words >= stream_update)) {
+    InitUnigramTable();
+    sampled_words = total_words;
+    rebuilt = 1;
+  }
+  pthread_mutex_lock(&stream_mutex);
+  if (rebuilt) {
+    alias_epoch++;
+    if (t != NULL) {
+      t->retired = alias_epoch;
+      t->next = retired_alias_tables;
+      retired_alias_tables = t;
+    }
+  }
+  for (oldest = alias_epoch, a = 0; a < num_threads; a++) if (stream_epochs[a] < oldest) oldest = stream_epochs[a];
+  for (r = &retired_alias_tables; *r != NULL;) {
+    if ((*r)->retired > oldest) {
+      r = &(*r)->next;
+      continue;
+    }
+    old = *r;
+    *r = old->next;
+    free(old);
+  }
+  stream_block_size[*block] = *used;
+  stream_full[(stream_full_head + stream_full_count++) % stream_block_count] = *block;
+  pthread_cond_broadcast(&stream_cond);
+  pthread_mutex_unlock(&stream_mutex);
+  *block = TakeFreeBlock();
+  *used = 0;
+}
+
+// Gives training thread 'id' the positions [*begin, *end) of the next block of the stream, after
+// returning its last one (*block >= 0) to the reader. Returns 0 when the stream has ended and
+// all blocks are trained
+int ClaimBlock(long long id, long long *block, long long *begin, long long *end) {
+  pthread_mutex_lock(&stream_mutex);
+  stream_epochs[id] = alias_epoch;
+  if (*block >= 0) {
+    stream_free[stream_free_count++] = *block;
+    pthread_cond_broadcast(&stream_cond);
+  }
+  *block = -1;
+  while (stream_full_count == 0 && !stream_done) pthread_cond_wait(&stream_cond, &stream_mutex);
+  if (stream_full_count == 0) {
+    pthread_mutex_unlock(&stream_mutex);
+    return 0;
   }
-  free(count);
-  free(binary);
-  free(parent_node);
+  *block = stream_full[stream_full_head];
+  stream_full_head = (stream_full_head + 1) % stream_block_count;
+  stream_full_count--;
+  *begin = *block * STREAM_BLOCK;
+  *end = *begin + stream_block_size[*block];
+  pthread_mutex_unlock(&stream_mutex);
+  return 1;
 }
 
-void LearnVocabFromTrainFile() {
-  srand(time(NULL));
-  char word[MAX_STRING];
-  char words[MAX_NGRAM][MAX_STRING];
-  char ngram[MAX_STRING*MAX_NGRAM + MAX_NGRAM];
-  FILE *fin;
-  long long a, i;
-  int n;
-  int is_beginning_of_sentence = 1;
-  for (a = 0; a < ngram_hash_size; a++) ngram_hash[a] = -1;
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
+// Initializes the rows of a new entry of the vocabulary as InitNet does
+void InitStreamRow(long long a, unsigned long long *next_random) {
+  long long b;
+  for (b = 0; b < layer1_size; b++) {
+    *next_random = *next_random * (unsigned long long)25214903917 + 11;
+    syn0[a * layer1_size + b] = (((*next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+  }
+  if (a < stream_ngram_base) memset(syn1neg + a * layer1_size, 0, layer1_size * sizeof(real));
+}
+
+// Counts a word of the stream and returns its id, or -1. A word that is not in the vocabulary is
+// counted as a candidate, and added once its count reaches -stream-min-count
+int StreamWord(char *word, int len, unsigned long long *next_random) {
+  struct ngram_table *t = &stream_candidates[1];
+  long long a = SearchVocab(word, len), e;
+  int i;
+  if (a >= 0) {
+    ngram_infos[a].cn++;
+    return a;
+  }
+  if (vocab_size >= stream_ngram_base) return -1;
+  e = CountWord(t, word, len, HashString(word, len));
+  if (GuaranteedCount(t, e) < stream_min_count) return -1;
+  a = vocab_size;
+  memset(&ngram_infos[a], 0, sizeof(struct ngram_info));
+  ngram_infos[a].word = AddString(&vocab_strings, word, len);
+  ngram_infos[a].cn = GuaranteedCount(t, e);
+  ngram_words[a * ngrams] = a;
+  for (i = 1; i < ngrams; i++) ngram_words[a * ngrams + i] = -1;
+  InitStreamRow(a, next_random);
+  AddWordToHash(a);
+  vocab_size++;
+  DropEntry(t, e);
+  return a;
+}
+
+// As StreamWord, for an ngram of order >= 2 of known words with the given HashNgram
+int StreamNgram(int *wids, int order, unsigned long long hash, unsigned long long *next_random) {
+  struct ngram_table *t = &stream_candidates[order];
+  long long a = SearchNgram(wids, order, hash), e;
+  int i;
+  if (a >= 0) {
+    ngram_infos[a].cn++;
+    return a;
+  }
+  if (stream_kept[order] >= max_ngrams) return -1;
+  e = CountNgram(t, wids, order, hash);
+  if (GuaranteedCount(t, e) < stream_min_count) return -1;
+  a = ngram_size;
+  memset(&ngram_infos[a], 0, sizeof(struct ngram_info));
+  ngram_infos[a].cn = GuaranteedCount(t, e);
+  for (i = 0; i < ngrams; i++) ngram_words[a * ngrams + i] = i < order ? wids[i] : -1;
+  InitStreamRow(a, next_random);
+  AddNgramToHash(a, hash);
+  ngram_size++;
+  stream_kept[order]++;
+  DropEntry(t, e);
+  return a;
+}
+
+void StopStream(int sig) {
+  stream_stop = 1;
+}
+
+// Reads the training data as it comes, from stdin for -train -, and encodes it into blocks. With
+// -stream 2 it waits for more at the end of the file, until SIGINT or SIGTERM. Only this thread
+// takes these signals, so they interrupt a read that waits for input
+void *StreamReaderThread(void *arg) {
+  char *buf = (char *)malloc(STREAM_READ), *word;
+  struct token_reader tr;
+  struct pollfd pfd;
+  sigset_t set;
+  unsigned long long hash, next_random = 1;
+  long long size = 0, end, used = 0, sentence_words = 0;
+  pid_t pid = 0;
+  int fd = strcmp(text_files[0].name, "-") ? OpenText(text_files[0].name, &pid) : 0, block = TakeFreeBlock(), wids[MAX_NGRAM], *rec;
+  int n, len, eof = 0, file = 0;
+  ssize_t got;
+  if (buf == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  if (fd < 0) {
     printf("ERROR: training data file not found!\n");
     exit(1);
   }
-  ngram_size = 0;
-  AddWordToVocab((char *)"</s>");
-  while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    if (!strcmp(word, "</s>")) {
-      is_beginning_of_sentence = 1;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+  while (!eof && !stream_stop) {
+    got = read(fd, buf + size, STREAM_READ - size);
+    if (got < 0 && errno == EINTR) continue;
+    if (got < 0) {
+      printf("ERROR: reading %s failed\n", text_files[file].name);
+      exit(1);
+    }
+    // The files of -train-list are read one after another, and each ends a sentence
+    if (got == 0 && file + 1 < text_file_count) {
+      CloseText(fd, pid, text_files[file].name);
+      fd = OpenText(text_files[++file].name, &pid);
+      if (fd < 0) {
+        printf("ERROR: training data file %s not found!\n", text_files[file].name);
+        exit(1);
+      }
+      if (size > 0 && size < STREAM_READ && buf[size - 1] != '\n') buf[size++] = '\n';
       continue;
     }
-    total_words++;
-    if ((debug_mode > 1) && (total_words % 100000 == 0)) {
-      printf("%lldK%c", total_words / 1000, 13);
-      fflush(stdout);
+    if (got == 0 && stream == 2) {
+      if (used > 0) PublishBlock(&block, &used);
+      usleep(100000);
+      continue;
     }
-    if (is_beginning_of_sentence) {
-      for (i = 0; i < ngrams; ++i) {
-        strcpy(words[i], "");
-      }
-      is_beginning_of_sentence = 0;
-    } else {
-      for ( i = 0; i+1 < ngrams; ++i ) {
-        strcpy(words[i], words[i+1]);
+    eof = got == 0;
+    size += got;
+    // Only whole tokens are read; the rest waits for more input, unless it fills the buffer
+    end = size;
+    while (!eof && end > 0 && buf[end - 1] != ' ' && buf[end - 1] != '\t' && buf[end - 1] != '\n') end--;
+    if (end == 0 && size == STREAM_READ) end = size;
+    tr.pos = buf;
+    tr.end = buf + end;
+    pthread_mutex_lock(&ingest_mutex);
+    while ((word = ReadToken(&tr, &len)) != NULL || (eof && sentence_words > 0)) {
+      rec = stream_records + ((long long)block * STREAM_BLOCK + used) * ngrams;
+      for (n = 1; n < ngrams; n++) rec[n] = -1;
+      if (word == NULL || (len == 4 && !memcmp(word, "</s>", 4))) {
+        if (sentence_words > 0) {
+          rec[0] = CACHE_EOS;
+          used++;
+        }
+        sentence_words = 0;
+      } else {
+        for (n = 0; n + 1 < ngrams; n++) wids[n] = wids[n + 1];
+        wids[ngrams - 1] = StreamWord(word, len, &next_random);
+        sentence_words++;
+        total_words++;
+        rec[0] = wids[ngrams - 1];
+        hash = wids[ngrams - 1] + 1;
+        for (n = 2; n <= ngrams && n <= sentence_words; n++) {
+          if (wids[ngrams - 1] == -1 || wids[ngrams - n] == -1) break;
+          hash = hash * NGRAM_HASH_MUL + wids[ngrams - n] + 1;
+          rec[n - 1] = StreamNgram(wids + ngrams - n, n, hash, &next_random);
+        }
+        used++;
       }
+      if (used == STREAM_BLOCK) PublishBlock(&block, &used);
     }
-    strcpy(words[ngrams-1] , word);
-    for (n = 1; n <= ngrams; ++n) {
-      if (min_reduce > 1 && rand()%min_reduce) {
-        continue;
-      }
-      strcpy(ngram, "");
-      for (i = ngrams - n; i < ngrams; ++i) {
-        if (words[i] == 0) {
-	  ngram[0] = 0;
-	  break;
-	}
-        if (ngram[0]) {
-	  strcat(ngram, " ");
-	}
-	strcat(ngram, words[i]);
-      }
-      if (ngram[0] == 0) {
-        continue;
-      }
-      i = SearchVocab(ngram);
-      if (i == -1) {
-        //AddWordToVocab(ngram);
-        a = AddWordToVocab(ngram);
-        ngram_infos[a].cn = 1;
-      } else ngram_infos[i].cn++;
-      while (ngram_size > ngram_hash_size * 0.7) ReduceNgram();
-    }
-//    if (!strcmp(word, "</s>")) {
-//      is_beginning_of_sentence = 1;
-//    } else {
-//      is_beginning_of_sentence = 0;
-//    }
+    pthread_mutex_unlock(&ingest_mutex);
+    memmove(buf, buf + end, size - end);
+    size -= end;
+    // When no more input is ready, the threads get what there is rather than wait for a full block
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (used > 0 && poll(&pfd, 1, 0) == 0) PublishBlock(&block, &used);
   }
-  SortNgram();
-  if (debug_mode > 0) {
-    printf("Vocab size: %lld\n", vocab_size);
-    printf("ngram size: %lld\n", ngram_size);
-    printf("Words in train file: %lld\n", total_words);
+  if (used > 0) PublishBlock(&block, &used);
+  if (fd != 0 && eof) CloseText(fd, pid, text_files[file].name);
+  else if (fd != 0) {
+    // Stopped early: a decompressor ends when its pipe closes
+    close(fd);
+    if (pid > 0) waitpid(pid, NULL, 0);
   }
-  file_size = ftell(fin);
-  fclose(fin);
-}
-
-void SaveVocab() {
-  long long i;
-  FILE *fo = fopen(save_vocab_file, "wb");
-  for (i = 0; i < vocab_size; i++) fprintf(fo, "%s %lld\n", ngram_infos[i].word, ngram_infos[i].cn);
-  fclose(fo);
+  free(buf);
+  pthread_mutex_lock(&stream_mutex);
+  stream_done = 1;
+  pthread_cond_broadcast(&stream_cond);
+  pthread_mutex_unlock(&stream_mutex);
+  pthread_exit(NULL);
 }
 
-void ReadVocab() {
-  long long a, i = 0;
-  char c;
-  char word[MAX_STRING];
-  FILE *fin = fopen(read_vocab_file, "rb");
-  if (fin == NULL) {
-    printf("Vocabulary file not found\n");
-    exit(1);
-  }
-  for (a = 0; a < ngram_hash_size; a++) ngram_hash[a] = -1;
-  vocab_size = 0;
-  while (1) {
-    ReadWord(word, fin);
-    if (feof(fin)) break;
-    a = AddWordToVocab(word);
-    fscanf(fin, "%lld%c", &ngram_infos[a].cn, &c);
-    i++;
-  }
-  SortNgram();
-  if (debug_mode > 0) {
-    printf("Vocab size: %lld\n", vocab_size);
-    printf("Words in train file: %lld\n", total_words);
-  }
-  fin = fopen(train_file, "rb");
-  if (fin == NULL) {
-    printf("ERROR: training data file not found!\n");
-    exit(1);
-  }
-  fseek(fin, 0, SEEK_END);
-  file_size = ftell(fin);
-  fclose(fin);
+// Pins the calling training thread to one CPU (-pin 1). The thread allocates its buffers after
+// this, so on a NUMA machine they are first touched, and placed, on the node of its CPU
+void PinThread(long long id) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) && debug_mode > 0) printf("Could not pin thread %lld\n", id);
+#endif
 }
 
+// With -storage f16 or bf16 the rows are stored as 16-bit numbers, converted by the kernels, so
+// InitKernels comes first
 void InitNet() {
   long long a, b;
-  unsigned long long next_random = 1;
-  a = posix_memalign((void **)&syn0, 128, (long long)ngram_size * layer1_size * sizeof(real));
-  if (syn0 == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  unsigned long long next_random = 1, rounding = 1;
+  real *row = (real *)malloc(layer1_size * sizeof(real));
+  if (stream) syn0 = ReserveRows(stream_ngram_base + max_ngrams * (ngrams - 1));
+  else if (storage != STORAGE_F32) a = posix_memalign((void **)&syn0_half, 128, (ngram_size + buckets) * layer1_size * sizeof(unsigned short));
+  else a = posix_memalign((void **)&syn0, 128, (ngram_size + buckets) * layer1_size * sizeof(real));
+  if ((syn0 == NULL && syn0_half == NULL) || row == NULL) {printf("Memory allocation failed\n"); exit(1);}
   if (hs) {
     a = posix_memalign((void **)&syn1, 128, (long long)vocab_size * layer1_size * sizeof(real));
     if (syn1 == NULL) {printf("Memory allocation failed\n"); exit(1);}
@@ -409,118 +3137,169 @@ void InitNet() {
      syn1[a * layer1_size + b] = 0;
   }
   if (negative>0) {
-    a = posix_memalign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(real));
-    if (syn1neg == NULL) {printf("Memory allocation failed\n"); exit(1);}
-    for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
+    if (stream) syn1neg = ReserveRows(stream_ngram_base);
+    else if (storage_outputs) {
+      // Zero is all zero bits in both 16-bit formats
+      syn1neg_half = (unsigned short *)calloc((long long)vocab_size * layer1_size, sizeof(unsigned short));
+      row_order = (int *)malloc((negative + 1) * sizeof(int));
+      if (syn1neg_half == NULL || row_order == NULL) {printf("Memory allocation failed\n"); exit(1);}
+      for (a = 0; a <= negative; a++) row_order[a] = a;
+    } else a = posix_memalign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(real));
+    if (syn1neg == NULL && syn1neg_half == NULL) {printf("Memory allocation failed\n"); exit(1);}
+    if (syn1neg) for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
      syn1neg[a * layer1_size + b] = 0;
   }
-  for (a = 0; a < ngram_size; a++) for (b = 0; b < layer1_size; b++) {
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    syn0[a * layer1_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+  for (a = 0; a < ngram_size + buckets; a++) {
+    for (b = 0; b < layer1_size; b++) {
+      next_random = next_random * (unsigned long long)25214903917 + 11;
+      row[b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_size;
+    }
+    if (syn0_half) StoreHalf(syn0_half + a * layer1_size, row, layer1_size, &rounding);
+    else memcpy(syn0 + a * layer1_size, row, layer1_size * sizeof(real));
   }
-  CreateBinaryTree();
+  free(row);
+  if (!tree_built) CreateBinaryTree();
 }
 
 void *TrainModelThread(void *id) {
-  long long a, b, d, cw, wid, last_word, sentence_length = 0, sentence_position = 0;
+  long long a, b, d, p, wid, last_word, sentence_length = 0, sentence_position = 0;
   int y;
-  long long word_count = 0, last_word_count = 0, sen[MAX_NGRAM][MAX_SENTENCE_LENGTH + 1];
-  long long l1, l2, c, target, label, local_iter = iter;
-  unsigned long long next_random = (long long)id;
-  real f, g;
-  clock_t now;
+  struct thread_state *state = &thread_states[(long long)id];
+  long long word_count = state->words, last_word_count = state->words, sen[MAX_NGRAM][MAX_SENTENCE_LENGTH + 1];
+  long long l1, c, target, words_done;
+  // A resumed thread first finishes the chunk it was in
+  long long epoch = state->epoch, chunk = state->chunk, begin = 0, pos = state->pos, end = 0;
+  unsigned long long next_random = state->next_random, sentences = 0, read_start = 0, gradient_start = 0;
+  struct thread_metrics *metrics = &thread_metrics[(long long)id];
+  long long pairs = 0, negatives = 0, misses = 0;
+  int sampled = 0;
+  double now;
+  real rate = starting_alpha;
+  if (pin_threads) PinThread((long long)id);
   real *neu1 = (real *)calloc(layer1_size, sizeof(real));
   real *neu1e = (real *)calloc(layer1_size, sizeof(real));
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
-  char word[MAX_STRING];
-  char words[MAX_NGRAM][MAX_STRING];
-  char ngram[MAX_STRING*MAX_NGRAM + MAX_NGRAM];
-  int is_beginning_of_sentence;
-  int i, n;
+  // Output rows, labels, dots and sigmoids of one TrainOutputs or TrainSharedNegatives batch
+  int max_ctx = 2 * window * ngrams;
+  int *rows = (int *)malloc((MAX_CODE_LENGTH + negative + 1) * sizeof(int));
+  real *labels = (real *)malloc((MAX_CODE_LENGTH + negative + 1) * sizeof(real));
+  real *fs = (real *)malloc((MAX_CODE_LENGTH + max_ctx) * (negative + 1) * sizeof(real));
+  real *ss = (real *)malloc((MAX_CODE_LENGTH + max_ctx) * (negative + 1) * sizeof(real));
+  int batch, ctx_size, *ctx = NULL, *points, codelen;
+  unsigned long long code;             // The Huffman code of the word trained by hierarchical softmax
+  real *in = NULL, *in_err = NULL, *out = NULL, *out_err = NULL;
+  // The input row as floats, and the output rows converted for TrainNegatives, with -storage
+  real *input, *row = (real *)malloc(layer1_size * sizeof(real)), *block = NULL;
+  if (syn1neg_half) block = (real *)malloc((negative + 1) * layer1_size * sizeof(real));
+  if (shared_negatives) {
+    ctx = (int *)malloc(max_ctx * sizeof(int));
+    in = (real *)malloc(max_ctx * layer1_size * sizeof(real));
+    in_err = (real *)malloc(max_ctx * layer1_size * sizeof(real));
+    out = (real *)malloc((negative + 1) * layer1_size * sizeof(real));
+    out_err = (real *)malloc((negative + 1) * layer1_size * sizeof(real));
+  }
+  // With -hot-rows, the thread's copies of the most frequent words of syn1neg and of the nodes
+  // next to the root of syn1
+  struct hot_rows *hot_neg = NULL, *hot_hs = NULL, hot[2];
+  long long flushed = word_count;
+  if (hot_rows > 0 && negative > 0) InitHotRows(hot_neg = &hot[0], syn1neg, syn1neg_half, 0, vocab_size);
+  if (hot_rows > 0 && hs) InitHotRows(hot_hs = &hot[1], syn1, NULL, vocab_size - 1 - hot_rows, vocab_size - 1);
+  int *rec;
+  int n;
   while (1) {
+    // The learning rate follows the words done by all threads, from one atomic counter
     if (word_count - last_word_count > 10000) {
-      word_count_actual += word_count - last_word_count;
+      words_done = __sync_add_and_fetch(&word_count_actual, word_count - last_word_count);
       last_word_count = word_count;
+      metrics->words = word_count;
+      metrics->pairs = pairs;
+      metrics->negatives = negatives;
+      metrics->misses = misses;
       if ((debug_mode > 1)) {
-        now=clock();
-        printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha,
-         word_count_actual / (real)(iter * total_words + 1) * 100,
-         word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
+        now = Now();
+        if (stream) printf("%cAlpha: %f  Words: %lldK  Vocabulary: %lld words, %lld ngrams  Words/thread/sec: %.2fk  ", 13, rate,
+         words_done / 1000, vocab_size, ngram_size - stream_ngram_base,
+         (words_done - start_words) / ((now - start + 1e-3) * num_threads * 1000));
+        else printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, rate,
+         words_done / (real)(iter * total_words + 1) * 100,
+         (words_done - start_words) / ((now - start + 1e-3) * num_threads * 1000));
         fflush(stdout);
       }
-      alpha = starting_alpha * (1 - word_count_actual / (real)(iter * total_words + 1));
-      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+      // A stream has no known end, so its learning rate stays at -alpha
+      if (!stream) rate = starting_alpha * (1 - words_done / (real)(iter * total_words + 1));
+      if (rate < starting_alpha * 0.0001) rate = starting_alpha * 0.0001;
     }
     if (sentence_length == 0) {
-      is_beginning_of_sentence = 1;
+      // The gradient work of a sampled sentence ends where the next sentence starts
+      if (sampled) metrics->cycles[CYCLES_GRADIENT] += Cycles() - gradient_start;
+      if (word_count - flushed >= hot_flush) {
+        if (hot_neg) FlushHotRows(hot_neg, syn1neg, syn1neg_half, 2, row, &next_random);
+        if (hot_hs) FlushHotRows(hot_hs, syn1, NULL, 1, row, &next_random);
+        flushed = word_count;
+      }
+      sampled = profile && sentences++ % PROFILE_SAMPLE == 0;
+      if (sampled) read_start = Cycles();
+      if (chunk >= 0 && end == 0) end = chunk_start[chunk + 1];
+      state->next_random = next_random;
+      state->epoch = epoch;
+      state->chunk = chunk;
+      state->pos = pos;
+      state->words = word_count;
       while (1) {
-        ReadWord(word, fi);
-        if (feof(fi)) break;
-        if (!strcmp(word, "</s>")) {
-	  is_beginning_of_sentence = 1;
-	  break;
-        } 
-	++word_count;
-        if (is_beginning_of_sentence) {
-          for (i = 0; i < ngrams; ++i) {
-            strcpy(words[i], "");
-          }
-	  is_beginning_of_sentence = 0;
-        } else {
-          for ( i = 0; i+1 < ngrams; ++i ) {
-            strcpy(words[i], words[i+1]);
-          }
-        }
-        strcpy(words[ngrams-1] , word);
-        for (n = 1; n <= ngrams; ++n) {
-          strcpy(ngram, "");
-          for (i = ngrams - n; i < ngrams; ++i) {
-            if (words[i] == 0) {
-              ngram[0] = 0;
-              break;
-            }
-            if (ngram[0]) {
-              strcat(ngram, " ");
+        // Chunks end at sentence ends, so a sentence never spans two of them
+        if (pos >= end) {
+          if (sentence_length > 0) break;
+          if (stream) {
+            if (!ClaimBlock((long long)id, &chunk, &begin, &end)) break;
+          } else {
+            if (chunk >= 0) {
+              chunk_done[epoch * chunk_count + chunk] = 1;
+              ReleasePages((char *)corpus_map, (char *)(corpus + chunk_start[chunk] * ngrams) - (char *)corpus_map,
+                           (char *)(corpus + chunk_start[chunk + 1] * ngrams) - (char *)corpus_map);
             }
-            strcat(ngram, words[i]);
+            if (!ClaimChunk((long long)id, &epoch, &chunk, &begin, &end)) break;
           }
-          if (ngram[0] == 0) {
-	    sen[n-1][sentence_length] = -1;
-            continue;
+          pos = begin;
+        }
+        rec = corpus + pos * ngrams;
+        pos++;
+        if (rec[0] == CACHE_EOS) {
+          if (sentence_length > 0) break;
+          continue;
+        }
+        ++word_count;
+        for (n = 0; n < ngrams; ++n) {
+          wid = rec[n];
+          // The first words of a sentence have no ngram of the higher orders to miss
+          if (wid == -1 && n <= sentence_length) misses++;
+          // The subsampling randomly discards frequent words while keeping the ranking same.
+          // Buckets have no count and hold rare ngrams, so they are all kept
+          if (wid != -1 && wid < ngram_size && sample > 0) {
+            real ran = (sqrt(ngram_infos[wid].cn / (sample * total_words)) + 1) * (sample * total_words) / ngram_infos[wid].cn;
+            next_random = next_random * (unsigned long long)25214903917 + 11;
+            if (ran < (next_random & 0xFFFF) / (real)65536) wid = -1;
           }
-          wid = SearchVocab(ngram);
-          if (wid != -1) {
-            if (sample > 0) {
-              real ran = (sqrt(ngram_infos[wid].cn / (sample * total_words)) + 1) * (sample * total_words) / ngram_infos[wid].cn;
-              next_random = next_random * (unsigned long long)25214903917 + 11;
-              if (ran < (next_random & 0xFFFF) / (real)65536) {
-	        sen[n-1][sentence_length] = -1;
-	      } else {
-	        sen[n-1][sentence_length] = wid;
-	      }
-            } else {
-	      sen[n-1][sentence_length] = wid;
-	    }
-          } 
+          sen[n][sentence_length] = wid;
         }
-      
-        // The subsampling randomly discards frequent words while keeping the ranking same
         sentence_length++;
         if (sentence_length >= MAX_SENTENCE_LENGTH) break;
       }
       sentence_position = 0;
+      if (sampled) {
+        gradient_start = Cycles();
+        metrics->cycles[CYCLES_READ] += gradient_start - read_start;
+      }
     }
 
-    if (feof(fi) || (word_count > total_words / num_threads)) {
-      word_count_actual += word_count - last_word_count;
-      local_iter--;
-      if (local_iter == 0) break;
-      word_count = 0;
-      last_word_count = 0;
-      sentence_length = 0;
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
-      continue;
+    if (sentence_length == 0) {
+      if (hot_neg) FlushHotRows(hot_neg, syn1neg, syn1neg_half, 2, row, &next_random);
+      if (hot_hs) FlushHotRows(hot_hs, syn1, NULL, 1, row, &next_random);
+      __sync_add_and_fetch(&word_count_actual, word_count - last_word_count);
+      metrics->words = word_count;
+      metrics->pairs = pairs;
+      metrics->negatives = negatives;
+      metrics->misses = misses;
+      if (__sync_add_and_fetch(&threads_done, 1) == num_threads) finish = Now();
+      break;
     }
     y = sen[0][sentence_position];
     if (y == -1) {
@@ -535,96 +3314,684 @@ void *TrainModelThread(void *id) {
     for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
     next_random = next_random * (unsigned long long)25214903917 + 11;
     b = next_random % window;
+    ctx_size = 0;
     for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-      c = sentence_position - window + a;
-      if (c < 0) continue;
-      if (c >= sentence_length) continue;
-      for (n = 0; n < ngrams; ++n) { 
-        // [c-n, c]
-        if (c-n <= sentence_position && c >= sentence_position) {
+      p = sentence_position - window + a;
+      if (p < 0) continue;
+      if (p >= sentence_length) continue;
+      for (n = 0; n < ngrams; ++n) {
+        // [p-n, p]
+        if (p-n <= sentence_position && p >= sentence_position) {
           continue;
         }
-        last_word = sen[n][c];
+        last_word = sen[n][p];
         if (last_word == -1) continue;
+        pairs++;
+        if (workers > 1) TouchRow(0, last_word);
+        // Shared negatives are trained once all the context of y is known
+        if (negative > 0 && shared_negatives) {
+          ctx[ctx_size++] = last_word;
+          if (!hs) continue;
+        }
         l1 = last_word * layer1_size;
-        for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-        // HIERARCHICAL SOFTMAX
-        if (hs) for (d = 0; d < ngram_infos[y].codelen; d++) {
-          f = 0;
-          l2 = ngram_infos[y].point[d] * layer1_size;
-          // Propagate hidden -> output
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1[c + l2];
-          if (f <= -MAX_EXP) continue;
-          else if (f >= MAX_EXP) continue;
-          else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-          // 'g' is the gradient multiplied by the learning rate
-          g = (1 - ngram_infos[y].code[d] - f) * alpha;
-          // Propagate errors output -> hidden
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
-          // Learn weights hidden -> output
-          for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * syn0[c + l1];
+        input = VectorRow(last_word, row);
+        memset(neu1e, 0, layer1_size * sizeof(real));
+        // HIERARCHICAL SOFTMAX: the nodes on the path of y all differ, and are trained as one
+        // block straight from vocab_points
+        if (hs) {
+          points = vocab_points + (long long)y * MAX_CODE_LENGTH;
+          code = vocab_codes[y];
+          codelen = ngram_infos[y].codelen;
+          for (d = 0; d < codelen; d++) labels[d] = 1 - (real)((code >> d) & 1);
+          if (workers > 1) for (d = 0; d < codelen; d++) TouchRow(1, points[d]);
+          TrainOutputs(input, syn1, hot_hs, points, labels, codelen, 1, neu1e, fs, ss, rate);
         }
-        // NEGATIVE SAMPLING
-        if (negative > 0) for (d = 0; d < negative + 1; d++) {
-          if (d == 0) {
-            target = y;
-            label = 1;
-          } else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = neg_table[(next_random >> 16) % neg_table_size];
-            if (target == 0) target = next_random % (vocab_size - 1) + 1;
+        // NEGATIVE SAMPLING: a negative drawn twice starts a new batch, so that it sees its
+        // first update
+        if (negative > 0 && !shared_negatives) {
+          rows[0] = y;
+          labels[0] = 1;
+          batch = 1;
+          if (workers > 1) TouchRow(2, y);
+          negatives += negative;
+          for (d = 1; d < negative + 1; d++) {
+            target = SampleNegative(&next_random);
             if (target == y) continue;
-            label = 0;
+            for (c = 0; c < batch; c++) if (rows[c] == target) break;
+            if (c < batch) {
+              TrainNegatives(input, hot_neg, rows, labels, batch, neu1e, fs, ss, rate, block, &next_random);
+              batch = 0;
+            }
+            rows[batch] = target;
+            labels[batch] = 0;
+            batch++;
+            if (workers > 1) TouchRow(2, target);
           }
-          l2 = target * layer1_size;
-          f = 0;
-          for (c = 0; c < layer1_size; c++) f += syn0[c + l1] * syn1neg[c + l2];
-          if (f > MAX_EXP) g = (label - 1) * alpha;
-          else if (f < -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * syn0[c + l1];
+          TrainNegatives(input, hot_neg, rows, labels, batch, neu1e, fs, ss, rate, block, &next_random);
         }
         // Learn weights input -> hidden
-        for (c = 0; c < layer1_size; c++) syn0[c + l1] += neu1e[c];
+        Axpy(input, 1, neu1e, layer1_size);
+        if (syn0_half) StoreHalf(syn0_half + l1, input, layer1_size, &next_random);
       }
     }
+    if (ctx_size > 0) {
+      TrainSharedNegatives(y, ctx, ctx_size, &next_random, hot_neg, rows, labels, in, in_err, out, out_err, fs, ss, rate);
+      negatives += negative;
+    }
     sentence_position++;
     if (sentence_position >= sentence_length) {
       sentence_length = 0;
       continue;
     }
   }
-  fclose(fi);
   free(neu1);
   free(neu1e);
+  free(rows);
+  free(labels);
+  free(fs);
+  free(ss);
+  free(ctx);
+  free(in);
+  free(in_err);
+  free(out);
+  free(out_err);
+  free(row);
+  free(block);
+  for (a = 0; a < 2; a++) if ((a == 0 ? hot_neg : hot_hs) != NULL) {
+    free(hot[a].local);
+    free(hot[a].base);
+  }
+  pthread_exit(NULL);
+}
+
+// Pads a vector file with zeros up to a multiple of align
+long long PadVectors(FILE *fo, long long offset, long long align) {
+  for (; offset % align; offset++) fputc(0, fo);
+  return offset;
+}
+
+// Saves the vectors in the format of embeddings.h, as floats or quantized to half precision
+// floats or to int8 with a scale per row (the largest absolute value maps to 127). The rows of
+// the buckets follow those of the vocabulary
+void SaveBinaryVectors(FILE *fo) {
+  struct embeddings_header header;
+  char name[MAX_NGRAM * MAX_STRING];
+  long long a, b, offset, rows = ngram_size + buckets, *index = (long long *)malloc(4096 * sizeof(long long));
+  unsigned char *row;
+  float *scales, max;
+  real *v, *buf = (real *)malloc(layer1_size * sizeof(real));
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "NG2VEMB", 8);
+  header.version = EMBEDDINGS_VERSION;
+  if (quantize[0] == 0 || !strcmp(quantize, "f32")) header.type = EMBEDDINGS_F32;
+  else if (!strcmp(quantize, "f16")) header.type = EMBEDDINGS_F16;
+  else header.type = EMBEDDINGS_I8;
+  header.ngrams = ngrams;
+  header.buckets = buckets;
+  header.rows = ngram_size;
+  header.dim = layer1_size;
+  header.row_size = layer1_size * (header.type == EMBEDDINGS_F32 ? 4 : header.type == EMBEDDINGS_F16 ? 2 : 1);
+  row = (unsigned char *)malloc(header.row_size);
+  scales = (float *)malloc(rows * sizeof(float));
+  if (index == NULL || row == NULL || scales == NULL || buf == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  fwrite(&header, sizeof(header), 1, fo);
+  // The string table, with the offsets first
+  header.index_offset = sizeof(header);
+  for (a = 0, offset = 0; a <= ngram_size; a++) {
+    index[a % 4096] = offset;
+    if (a < ngram_size) offset += NgramName(a, name) + 1;
+    if (a % 4096 == 4095 || a == ngram_size) fwrite(index, sizeof(long long), a % 4096 + 1, fo);
+  }
+  header.strings_offset = header.index_offset + (ngram_size + 1) * sizeof(long long);
+  header.strings_size = offset;
+  for (a = 0; a < ngram_size; a++) fwrite(name, 1, NgramName(a, name) + 1, fo);
+  offset = PadVectors(fo, header.strings_offset + header.strings_size, sizeof(float));
+  if (header.type == EMBEDDINGS_I8) {
+    for (a = 0; a < rows; a++) {
+      v = VectorRow(a, buf);
+      for (b = 0, max = 0; b < layer1_size; b++) if (fabs(v[b]) > max) max = fabs(v[b]);
+      scales[a] = max / 127;
+    }
+    header.scales_offset = offset;
+    fwrite(scales, sizeof(float), rows, fo);
+    offset += rows * sizeof(float);
+  }
+  header.vectors_offset = PadVectors(fo, offset, EMBEDDINGS_ALIGN);
+  for (a = 0; a < rows; a++) {
+    v = VectorRow(a, buf);
+    if (header.type == EMBEDDINGS_F32) for (b = 0; b < layer1_size; b++) ((float *)row)[b] = v[b];
+    else if (header.type == EMBEDDINGS_F16) for (b = 0; b < layer1_size; b++) ((unsigned short *)row)[b] = FloatToHalf(v[b]);
+    else for (b = 0; b < layer1_size; b++) ((signed char *)row)[b] = scales[a] > 0 ? (signed char)lrintf(v[b] / scales[a]) : 0;
+    fwrite(row, 1, header.row_size, fo);
+  }
+  header.file_size = header.vectors_offset + rows * header.row_size;
+  fseek(fo, 0, SEEK_SET);
+  fwrite(&header, sizeof(header), 1, fo);
+  free(index);
+  free(row);
+  free(scales);
+  free(buf);
+}
+
+// Writes x to s as printf("%.*f", precision, x) would and returns the length. A float times
+// 10^precision is exact in a double for precision <= 12 (the power of 5 takes at most 28 bits),
+// so rounding it to an integer rounds like printf; larger numbers go through snprintf
+int FormatReal(char *s, real x) {
+  static const double scale[13] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12};
+  char digits[24];
+  unsigned long long n;
+  int len = 0, d = 0, i;
+  double y = fabs((double)x) * scale[precision];
+  if (!(y < 1e18)) return sprintf(s, "%.*f", precision, x);
+  if (signbit(x)) s[len++] = '-';
+  n = (unsigned long long)llrint(y);
+  do {
+    digits[d++] = '0' + n % 10;
+    n /= 10;
+  } while (n > 0 || d <= precision);
+  for (i = d - 1; i >= 0; i--) {
+    s[len++] = digits[i];
+    if (i == precision && precision > 0) s[len++] = '.';
+  }
+  return len;
+}
+
+// Used by the threads of the text export
+long long export_block_count, export_next_block;
+int export_fd, export_failed;
+pthread_mutex_t export_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;
+
+// Formats the blocks of EXPORT_BLOCK_ROWS lines id, id + num_threads, ... of the text output
+// into a buffer and writes each one when all blocks before it are written, so formatting runs
+// in parallel and the file is written in order
+void *ExportTextThread(void *id) {
+  long long a, b, block, len, done, n;
+  // Numbers take at most 56 characters, 39 digits for FLT_MAX, the sign, the point and 12 decimals
+  long long max_line = ngrams * MAX_STRING + layer1_size * 57 + 2, size = max_line * 64;
+  char *buf = (char *)malloc(size);
+  real *v, *row = (real *)malloc(layer1_size * sizeof(real));
+  for (block = (long long)id; block < export_block_count; block += num_threads) {
+    len = 0;
+    for (a = block * EXPORT_BLOCK_ROWS; a < ngram_size && a < (block + 1) * EXPORT_BLOCK_ROWS; a++) {
+      if (len + max_line > size) {
+        size = size * 2;
+        buf = (char *)realloc(buf, size);
+      }
+      if (buf == NULL) {printf("Memory allocation failed\n"); exit(1);}
+      len += NgramName(a, buf + len);
+      v = VectorRow(a, row);
+      for (b = 0; b < layer1_size; b++) {
+        buf[len++] = '\t';
+        len += FormatReal(buf + len, v[b]);
+      }
+      buf[len++] = '\n';
+    }
+    pthread_mutex_lock(&export_mutex);
+    while (export_next_block != block) pthread_cond_wait(&export_cond, &export_mutex);
+    pthread_mutex_unlock(&export_mutex);
+    for (done = 0; done < len && !export_failed; done += n) {
+      n = write(export_fd, buf + done, len - done);
+      if (n <= 0) export_failed = 1;
+    }
+    pthread_mutex_lock(&export_mutex);
+    export_next_block++;
+    pthread_cond_broadcast(&export_cond);
+    pthread_mutex_unlock(&export_mutex);
+  }
+  free(buf);
+  free(row);
   pthread_exit(NULL);
 }
 
+// Saves the vectors: as text, one ngram per line with tab separated numbers; with -binary 1 as
+// the ngram followed by the raw floats; with -binary 2 in the mappable format of embeddings.h
+void SaveVectors() {
+  long long a;
+  real *row = (real *)malloc(layer1_size * sizeof(real));
+  FILE *fo = fopen(output_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot open %s\n", output_file);
+    exit(1);
+  }
+  if (binary == 2) SaveBinaryVectors(fo);
+  else if (binary) {
+    fprintf(fo, "%lld\t%lld\n", ngram_size, layer1_size);
+    for (a = 0; a < ngram_size; a++) {
+      PrintNgram(fo, a);
+      fwrite(VectorRow(a, row), sizeof(real), layer1_size, fo);
+      fprintf(fo, "\n");
+    }
+  } else {
+    fprintf(fo, "%lld\t%lld\n", ngram_size, layer1_size);
+    fflush(fo);
+    export_fd = fileno(fo);
+    export_block_count = (ngram_size + EXPORT_BLOCK_ROWS - 1) / EXPORT_BLOCK_ROWS;
+    export_next_block = 0;
+    export_failed = 0;
+    RunThreads(ExportTextThread);
+  }
+  free(row);
+  if (ferror(fo) | fclose(fo) | export_failed) {
+    printf("ERROR: writing %s failed\n", output_file);
+    exit(1);
+  }
+}
+
+// Writes size bytes to fd; used by the checkpoint process, which only makes system calls
+void WriteAll(int fd, void *data, long long size) {
+  long long done = 0, n;
+  while (done < size) {
+    n = write(fd, (char *)data + done, size - done > (1 << 30) ? 1 << 30 : size - done);
+    if (n <= 0) _exit(1);
+    done += n;
+  }
+}
+
+// Writes a checkpoint from a forked copy of the process. The copy sees the memory as it was at
+// the fork (copy-on-write), so training goes on while it writes; it writes a temporary file and
+// renames it over the checkpoint, so a checkpoint is always complete. Returns the child's pid
+pid_t StartCheckpoint() {
+  struct checkpoint_header header;
+  char tmp[MAX_PATH + 8];
+  long long a, b, buf[4096];
+  int fd;
+  pid_t pid = fork();
+  if (pid != 0) return pid;
+  if (stream) CompactStreamVocab();
+  snprintf(tmp, sizeof(tmp), "%s.tmp", checkpoint_file);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) _exit(1);
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "NG2VCKPT", 8);
+  header.version = CHECKPOINT_VERSION;
+  header.ngrams = ngrams;
+  header.hs = hs;
+  header.negative = negative;
+  header.num_threads = num_threads;
+  header.storage = storage;
+  header.storage_outputs = storage_outputs;
+  header.layer1_size = layer1_size;
+  header.ngram_size = ngram_size;
+  header.vocab_size = vocab_size;
+  header.strings_size = vocab_strings.size;
+  header.iter = iter;
+  header.chunk_count = chunk_count;
+  header.buckets = buckets;
+  WriteAll(fd, &header, sizeof(header));
+  // The counts and word offsets go through a buffer, as they are fields of ngram_info
+  for (b = 0; b < 2; b++) for (a = 0; a < ngram_size; a++) {
+    buf[a % 4096] = b == 0 ? ngram_infos[a].cn : ngram_infos[a].word;
+    if (a % 4096 == 4095 || a == ngram_size - 1) WriteAll(fd, buf, (a % 4096 + 1) * sizeof(long long));
+  }
+  WriteAll(fd, ngram_words, ngram_size * ngrams * sizeof(int));
+  WriteAll(fd, vocab_strings.data, vocab_strings.size);
+  if (syn0_half) WriteAll(fd, syn0_half, (ngram_size + buckets) * layer1_size * sizeof(unsigned short));
+  else WriteAll(fd, syn0, (ngram_size + buckets) * layer1_size * sizeof(real));
+  if (hs) WriteAll(fd, syn1, vocab_size * layer1_size * sizeof(real));
+  if (syn1neg_half) WriteAll(fd, syn1neg_half, vocab_size * layer1_size * sizeof(unsigned short));
+  else if (negative > 0) WriteAll(fd, syn1neg, vocab_size * layer1_size * sizeof(real));
+  WriteAll(fd, chunk_done, iter * chunk_count);
+  WriteAll(fd, thread_states, num_threads * sizeof(struct thread_state));
+  if (fsync(fd) || close(fd) || rename(tmp, checkpoint_file)) _exit(1);
+  _exit(0);
+}
+
+// Reads size bytes of a checkpoint
+void ReadCheckpoint(void *data, long long size, FILE *fin) {
+  if ((long long)fread(data, 1, size, fin) != size) {
+    printf("ERROR: checkpoint %s is truncated\n", checkpoint_file);
+    exit(1);
+  }
+}
+
+// Reads the vocabulary of a checkpoint, in place of counting the training file
+FILE *ResumeVocab(struct checkpoint_header *header) {
+  long long a, *buf;
+  FILE *fin = fopen(checkpoint_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: checkpoint %s not found\n", checkpoint_file);
+    exit(1);
+  }
+  ReadCheckpoint(header, sizeof(struct checkpoint_header), fin);
+  if (memcmp(header->magic, "NG2VCKPT", 8) || header->version != CHECKPOINT_VERSION) {
+    printf("ERROR: %s is not a checkpoint of this version\n", checkpoint_file);
+    exit(1);
+  }
+  if (header->ngrams != ngrams || header->hs != hs || header->negative != negative || header->layer1_size != layer1_size
+      || header->storage != storage || header->storage_outputs != storage_outputs || header->buckets != buckets
+      || (!stream && (header->num_threads != num_threads || header->iter != iter))) {
+    printf("ERROR: -ngrams, -hs, -negative, -threads, -size, -iter, -storage and -buckets must be the same as for the checkpoint\n");
+    exit(1);
+  }
+  ngram_size = header->ngram_size;
+  vocab_size = header->vocab_size;
+  ngram_max_size = ngram_size + 1000;
+  ngram_infos = (struct ngram_info *)realloc(ngram_infos, ngram_max_size * sizeof(struct ngram_info));
+  ngram_words = (int *)realloc(ngram_words, ngram_max_size * ngrams * sizeof(int));
+  buf = (long long *)malloc(ngram_size * sizeof(long long));
+  vocab_strings.data = (char *)realloc(vocab_strings.data, header->strings_size);
+  vocab_strings.size = vocab_strings.max_size = header->strings_size;
+  if (ngram_infos == NULL || ngram_words == NULL || buf == NULL || vocab_strings.data == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  memset(ngram_infos, 0, ngram_max_size * sizeof(struct ngram_info));
+  ReadCheckpoint(buf, ngram_size * sizeof(long long), fin);
+  for (a = 0; a < ngram_size; a++) ngram_infos[a].cn = buf[a];
+  ReadCheckpoint(buf, ngram_size * sizeof(long long), fin);
+  for (a = 0; a < ngram_size; a++) ngram_infos[a].word = buf[a];
+  free(buf);
+  ReadCheckpoint(ngram_words, ngram_size * ngrams * sizeof(int), fin);
+  ReadCheckpoint(vocab_strings.data, vocab_strings.size, fin);
+  // The vocabulary is kept in its order, which for -stream is not that of the counts
+  IndexVocab();
+  if (debug_mode > 0) printf("Resuming from %s: %lld words and %lld ngrams\n", checkpoint_file, vocab_size, ngram_size);
+  return fin;
+}
+
+// Reads the weights and the training position of a checkpoint, after InitNet and InitChunks.
+// A thread resumes the chunk it was in from its last sentence start; the chunks done before the
+// checkpoint, and those, are not claimed again
+void ResumeTraining(struct checkpoint_header *header, FILE *fin) {
+  long long a;
+  if (syn0_half) ReadCheckpoint(syn0_half, (ngram_size + buckets) * layer1_size * sizeof(unsigned short), fin);
+  else ReadCheckpoint(syn0, (ngram_size + buckets) * layer1_size * sizeof(real), fin);
+  if (hs) ReadCheckpoint(syn1, vocab_size * layer1_size * sizeof(real), fin);
+  if (syn1neg_half) ReadCheckpoint(syn1neg_half, vocab_size * layer1_size * sizeof(unsigned short), fin);
+  else if (negative > 0) ReadCheckpoint(syn1neg, vocab_size * layer1_size * sizeof(real), fin);
+  // A stream goes on with new data, not where the checkpoint was
+  if (stream) {
+    fclose(fin);
+    return;
+  }
+  if (header->chunk_count != chunk_count) {
+    printf("ERROR: the corpus cache does not match the checkpoint\n");
+    exit(1);
+  }
+  ReadCheckpoint(chunk_done, iter * chunk_count, fin);
+  ReadCheckpoint(thread_states, num_threads * sizeof(struct thread_state), fin);
+  fclose(fin);
+  for (a = 0; a < num_threads; a++) {
+    if (thread_states[a].chunk < 0) continue;
+    if (chunk_done[thread_states[a].epoch * chunk_count + thread_states[a].chunk]) thread_states[a].chunk = -1;
+    else chunk_done[thread_states[a].epoch * chunk_count + thread_states[a].chunk] = 2;
+  }
+  // Unlike word_count_actual, the thread counts agree with the positions
+  for (a = 0; a < num_threads; a++) word_count_actual += thread_states[a].words;
+}
+
+// Appends a JSON line with the progress, the counters of every thread and, at the end, the
+// time of every phase to the -metrics file. Cycle counts are scaled up from the sample
+void WriteMetrics(FILE *fm, int done) {
+  long long a, words = word_count_actual;
+  double elapsed = done ? phase_time[PHASE_TRAIN] : Now() - start;
+  real rate = stream ? starting_alpha : starting_alpha * (1 - words / (real)(iter * total_words + 1));
+  int b;
+  if (rate < starting_alpha * 0.0001) rate = starting_alpha * 0.0001;
+  fprintf(fm, "{\"time\": %.3f, \"phase\": \"%s\", \"words\": %lld, \"progress\": %.6f, \"alpha\": %.6f, ",
+          elapsed, done ? "done" : "train", words, stream ? 0 : words / (double)(iter * total_words + 1), rate);
+  if (stream) fprintf(fm, "\"vocab_words\": %lld, \"vocab_ngrams\": %lld, ", vocab_size, ngram_size - (done ? vocab_size : stream_ngram_base));
+  fprintf(fm, "\"words_per_sec\": %.1f, \"threads\": [", (words - start_words) / (elapsed + 1e-9));
+  for (a = 0; a < num_threads; a++) {
+    struct thread_metrics *m = &thread_metrics[a];
+    fprintf(fm, "%s{\"words\": %lld, \"pairs\": %lld, \"negatives\": %lld, \"misses\": %lld", a ? ", " : "", m->words, m->pairs, m->negatives, m->misses);
+    if (profile) for (b = CYCLES_READ; b <= CYCLES_GRADIENT; b++) fprintf(fm, ", \"%s_cycles\": %lld", cycle_names[b], m->cycles[b] * PROFILE_SAMPLE);
+    fprintf(fm, "}");
+  }
+  fprintf(fm, "]");
+  if (done) {
+    fprintf(fm, ", \"phases\": {");
+    for (b = 0; b < PHASES; b++) fprintf(fm, "%s\"%s\": %.3f", b ? ", " : "", phase_names[b], phase_time[b]);
+    fprintf(fm, "}, \"max_rss_kb\": %lld", MaxRss());
+    if (profile) for (b = CYCLES_TOKENIZE; b <= CYCLES_LOOKUP; b++) fprintf(fm, ", \"%s_cycles\": %lld", cycle_names[b], encode_cycles[b] * PROFILE_SAMPLE);
+  }
+  fprintf(fm, "}\n");
+  fflush(fm);
+}
+
+// Adds what the rows changed since the last sync have learned to the shared model. The rows become
+// synced, with their values as of now as the base of the next exchange
+void PushRows() {
+  long long r, c;
+  int m, *lock;
+  real *l, *s, *b, x;
+  for (m = 0; m < 3; m++) for (r = 0; r < sync_rows[m]; r++) if (sync_state[m][r] == 2) {
+    l = sync_local[m] + r * layer1_size;
+    s = sync_shared[m] + r * layer1_size;
+    b = sync_base[m] + r * layer1_size;
+    lock = &sync_locks[(r * 3 + m) % SYNC_LOCKS];
+    while (__sync_lock_test_and_set(lock, 1)) while (*(volatile int *)lock) ;
+    for (c = 0; c < layer1_size; c++) {
+      x = l[c];
+      s[c] += x - b[c];
+      b[c] = x;
+    }
+    __sync_lock_release(lock);
+    sync_state[m][r] = 1;
+  }
+}
+
+// Syncs a worker every -sync-words words it trains, and once more when its threads are done. The
+// words of the other workers are added to word_count_actual, so the learning rate follows them all
+void *SyncThread(void *arg) {
+  long long a, own, others, others_added = 0, last = 0, first = num_threads * worker_id / workers;
+  long long threads = num_threads * (worker_id + 1) / workers - first;
+  int done;
+  while (1) {
+    usleep(10000);
+    done = __atomic_load_n(&threads_done, __ATOMIC_ACQUIRE) == threads;
+    own = word_count_actual - others_added;
+    if (!done && own - last < sync_words) continue;
+    last = own;
+    PushRows();
+    __atomic_store_n(&worker_words[worker_id], own, __ATOMIC_RELEASE);
+    for (others = 0, a = 0; a < workers; a++) if (a != worker_id) others += __atomic_load_n(&worker_words[a], __ATOMIC_ACQUIRE);
+    __sync_add_and_fetch(&word_count_actual, others - others_added);
+    others_added = others;
+    if (done) break;
+  }
+  return NULL;
+}
+
+// The body of a worker process: its threads of the -threads, which train the chunks of their queues
+void RunWorker() {
+  long long a, first = num_threads * worker_id / workers, last = num_threads * (worker_id + 1) / workers;
+  pthread_t *pt = (pthread_t *)malloc((last - first) * sizeof(pthread_t)), sync;
+  int m;
+  for (m = 0; m < 3; m++) {
+    if (sync_rows[m] == 0) continue;
+    sync_state[m] = (char *)calloc(sync_rows[m], 1);
+    sync_base[m] = ReserveRows(sync_rows[m]);
+    if (sync_state[m] == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  }
+  // Only the first worker shows the progress
+  if (worker_id > 0 && debug_mode > 1) debug_mode = 1;
+  pthread_create(&sync, NULL, SyncThread, NULL);
+  for (a = first; a < last; a++) pthread_create(&pt[a - first], NULL, TrainModelThread, (void *)a);
+  for (a = first; a < last; a++) pthread_join(pt[a - first], NULL);
+  pthread_join(sync, NULL);
+}
+
+// Trains with -workers processes. The shared memory holds the spin locks, the words of every
+// worker and the shared model, which starts as a copy of the model and is copied back at the end;
+// thread_metrics is shared as well, so that -metrics counts all the threads
+void RunWorkers(FILE *fm) {
+  long long a, b, offset, size, bytes[3];
+  real *model[3] = {syn0, syn1, syn1neg};
+  char *shared;
+  pid_t *pids = (pid_t *)malloc(workers * sizeof(pid_t)), pid;
+  int m, status, running = workers, failed = 0;
+  double last_metrics = Now();
+  sync_rows[0] = ngram_size + buckets;
+  sync_rows[1] = hs ? vocab_size : 0;
+  sync_rows[2] = negative > 0 ? vocab_size : 0;
+  size = offset = (SYNC_LOCKS * sizeof(int) + workers * sizeof(long long) + 127) / 128 * 128;
+  for (m = 0; m < 3; m++) size += bytes[m] = sync_rows[m] * layer1_size * sizeof(real);
+  shared = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED || pids == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  sync_locks = (int *)shared;
+  worker_words = (long long *)(shared + SYNC_LOCKS * sizeof(int));
+  for (m = 0; m < 3; m++) {
+    sync_local[m] = model[m];
+    sync_shared[m] = (real *)(shared + offset);
+    if (bytes[m] > 0) memcpy(sync_shared[m], model[m], bytes[m]);
+    offset += bytes[m];
+  }
+  fflush(stdout);
+  for (a = 0; a < workers; a++) {
+    pids[a] = fork();
+    if (pids[a] == 0) {
+      worker_id = a;
+      RunWorker();
+      fflush(stdout);
+      _exit(0);
+    }
+    if (pids[a] < 0) {
+      printf("ERROR: cannot start worker %lld\n", a);
+      for (b = 0; b < a; b++) kill(pids[b], SIGKILL);
+      exit(1);
+    }
+  }
+  while (running > 0) {
+    pid = waitpid(-1, &status, WNOHANG);
+    if (pid > 0) {
+      running--;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) failed = 1;
+      continue;
+    }
+    usleep(10000);
+    if (fm != NULL && Now() - last_metrics >= metrics_interval) {
+      for (word_count_actual = 0, a = 0; a < num_threads; a++) word_count_actual += thread_metrics[a].words;
+      WriteMetrics(fm, 0);
+      last_metrics = Now();
+    }
+  }
+  finish = Now();
+  if (failed) {
+    printf("ERROR: a worker process failed\n");
+    exit(1);
+  }
+  for (word_count_actual = 0, a = 0; a < num_threads; a++) word_count_actual += thread_metrics[a].words;
+  for (m = 0; m < 3; m++) if (bytes[m] > 0) memcpy(model[m], sync_shared[m], bytes[m]);
+  munmap(shared, size);
+  free(pids);
+  threads_done = num_threads;
+}
+
 void TrainModel() {
-  long a, b, c, d;
-  FILE *fo;
-  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-  printf("Starting training using file %s\n", train_file);
+  long a;
+  FILE *fin = NULL, *fm = NULL;
+  struct checkpoint_header header;
+  pid_t checkpoint = 0;
+  double t, sorted, last_checkpoint, last_metrics;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t)), reader;
+  struct sigaction sa;
+  sigset_t set;
+  if (train_list[0] != 0) printf("Starting training using the files listed in %s\n", train_list);
+  else printf("Starting training using file %s\n", train_file);
   starting_alpha = alpha;
-  if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
-  if (save_vocab_file[0] != 0) SaveVocab();
+  if (metrics_file[0] != 0) {
+    fm = fopen(metrics_file, "a");
+    if (fm == NULL) {
+      printf("ERROR: cannot open %s\n", metrics_file);
+      exit(1);
+    }
+  }
+  // Sorting and the Huffman tree are timed inside, and not counted again in the phases around them
+  t = Now();
+  sorted = phase_time[PHASE_SORT];
+  if (resume) fin = ResumeVocab(&header);
+  else if (read_vocab_file[0] != 0) ReadVocab();
+  else if (stream) {
+    // The vocabulary of a stream is learned while training
+    AddWordToVocab((char *)"</s>");
+    SortNgram();
+  } else LearnVocabFromTrainFile();
+  if (save_vocab_file[0] != 0 && !stream) SaveVocab();
+  phase_time[PHASE_VOCAB] = Now() - t - (phase_time[PHASE_SORT] - sorted);
   if (output_file[0] == 0) return;
+  if (max_memory > 0) ReportMemoryPlan();
+  t = Now();
+  InitKernels(kernel_name);
   InitNet();
-  if (negative > 0) InitUnigramTable();
-  start = clock();
-  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
-  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
-  fo = fopen(output_file, "wb");
-  // Save the word vectors
-  fprintf(fo, "%lld\t%lld\n", ngram_size, layer1_size);
-  for (a = 0; a < ngram_size; a++) {
-    fprintf(fo, "%s", ngram_infos[a].word);
-    if (binary) for (b = 0; b < layer1_size; b++) fwrite(&syn0[a * layer1_size + b], sizeof(real), 1, fo);
-    else for (b = 0; b < layer1_size; b++) fprintf(fo, "\t%lf", syn0[a * layer1_size + b]);
-    fprintf(fo, "\n");
+  if (debug_mode > 0) printf("Kernels: %s\n", kernel_name);
+  if (negative > 0 && !stream) InitUnigramTable();
+  phase_time[PHASE_INIT] = Now() - t - phase_time[PHASE_HUFFMAN];
+  t = Now();
+  if (!stream) LoadCorpusCache();
+  phase_time[PHASE_ENCODE] = Now() - t;
+  t = Now();
+  InitChunks();
+  // Shared with the processes of -workers
+  thread_metrics = (struct thread_metrics *)mmap(NULL, num_threads * sizeof(struct thread_metrics), PROT_READ | PROT_WRITE,
+                                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (thread_metrics == MAP_FAILED) {printf("Memory allocation failed\n"); exit(1);}
+  if (resume) ResumeTraining(&header, fin);
+  if (stream) {
+    InitStream();
+    // SIGINT and SIGTERM end the stream; they are blocked in all threads but the reader
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = StopStream;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
   }
-  fclose(fo);
+  phase_time[PHASE_INIT] += Now() - t;
+  start = Now();
+  start_words = word_count_actual;
+  if (stream) pthread_create(&reader, NULL, StreamReaderThread, NULL);
+  if (workers > 1) RunWorkers(fm);
+  else for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
+  // Every -checkpoint-interval seconds, unless the last checkpoint is still being written, and
+  // every -metrics-interval seconds
+  last_checkpoint = last_metrics = Now();
+  while ((checkpoint_file[0] != 0 || fm != NULL) && threads_done < num_threads) {
+    sleep(1);
+    if (fm != NULL && Now() - last_metrics >= metrics_interval) {
+      WriteMetrics(fm, 0);
+      last_metrics = Now();
+    }
+    if (checkpoint_file[0] == 0) continue;
+    if (checkpoint > 0 && waitpid(checkpoint, NULL, WNOHANG) == checkpoint) checkpoint = 0;
+    if (checkpoint == 0 && Now() - last_checkpoint >= checkpoint_interval) {
+      pthread_mutex_lock(&ingest_mutex);
+      checkpoint = StartCheckpoint();
+      pthread_mutex_unlock(&ingest_mutex);
+      last_checkpoint = Now();
+      if (checkpoint < 0) {
+        printf("Could not start a checkpoint\n");
+        checkpoint = 0;
+      }
+    }
+  }
+  if (workers == 1) for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  phase_time[PHASE_TRAIN] = finish - start;
+  if (checkpoint > 0) waitpid(checkpoint, NULL, 0);
+  if (stream) {
+    pthread_join(reader, NULL);
+    CompactStreamVocab();
+    if (debug_mode > 0) printf("\nVocab size: %lld\nngram size: %lld\nWords in stream: %lld\n", vocab_size, ngram_size, total_words);
+    if (save_vocab_file[0] != 0) SaveVocab();
+  }
+  t = Now();
+  SaveVectors();
+  phase_time[PHASE_SAVE] = Now() - t;
+  if (debug_mode > 0) {
+    printf("\nPhases:");
+    for (a = 0; a < PHASES; a++) printf(" %s %.2fs", phase_names[a], phase_time[a]);
+    printf(", peak memory %lld MB\n", MaxRss() / 1024);
+  }
+  if (fm != NULL) {
+    WriteMetrics(fm, 1);
+    fclose(fm);
+  }
+  if (!stream) munmap(corpus_map, corpus_map_size);
+  free(chunk_start);
+  free(chunk_queues);
+  free(chunk_done);
+  free(thread_states);
+  munmap(thread_metrics, num_threads * sizeof(struct thread_metrics));
 }
 
 int ArgPos(char *str, int argc, char **argv) {
@@ -639,6 +4006,15 @@ int ArgPos(char *str, int argc, char **argv) {
   return -1;
 }
 
+// Copies the file name given to an option into a MAX_PATH buffer, or stops if it is too long
+void PathArg(char *path, char *arg, char *option) {
+  if (strlen(arg) >= MAX_PATH) {
+    printf("ERROR: the file name of %s is longer than %d bytes\n", option, MAX_PATH - 1);
+    exit(1);
+  }
+  strcpy(path, arg);
+}
+
 int main(int argc, char **argv) {
   int i;
   if (argc == 1) {
@@ -646,7 +4022,12 @@ int main(int argc, char **argv) {
     printf("Options:\n");
     printf("Parameters for training:\n");
     printf("\t-train <file>\n");
-    printf("\t\tUse text data from <file> to train the model\n");
+    printf("\t\tUse text data from <file> to train the model; it may be compressed with gzip or zstd\n");
+    printf("\t-train-list <file>\n");
+    printf("\t\tUse the text of the files listed in <file>, one per line, each plain, gzip or zstd, instead of -train\n");
+    printf("\t-decompress-threads <int>\n");
+    printf("\t\tThreads that read compressed or listed files ahead of counting and encoding, each with its own\n");
+    printf("\t\tdecompressor process; default is the number of files, up to -threads\n");
     printf("\t-output <file>\n");
     printf("\t\tUse <file> to save the resulting word vectors / word clusters\n");
     printf("\t-size <int>\n");
@@ -669,13 +4050,76 @@ int main(int argc, char **argv) {
     printf("\t-debug <int>\n");
     printf("\t\tSet the debug mode (default = 2 = more info during training)\n");
     printf("\t-binary <int>\n");
-    printf("\t\tSave the resulting vectors in binary moded; default is 0 (off)\n");
+    printf("\t\tSave the resulting vectors in binary moded; default is 0 (off); 2 writes the mappable format of embeddings.h\n");
+    printf("\t-precision <int>\n");
+    printf("\t\tDecimals of the numbers in the text output, up to 12; default is 6\n");
+    printf("\t-quantize <name>\n");
+    printf("\t\tStore the vectors of -binary 2 as f32 (default), f16 or int8 (with a scale per row)\n");
     printf("\t-save-ngram_infos <file>\n");
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-read-ngram_infos <file>\n");
-    printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+    printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data; a binary one is used\n");
+    printf("\t\tas it was saved, with its ngrams and Huffman tree\n");
+    printf("\t-vocab-binary <int>\n");
+    printf("\t\tSave the vocabulary as a binary file with all ngrams, counts, hashes and the Huffman tree, which\n");
+    printf("\t\t-read-ngram_infos maps without counting again; default is 0 (text, words only)\n");
     printf("\t-ngrams <int>\n");
     printf("\t\tmax ngram (default = 1)\n");
+    printf("\t-cache <file>\n");
+    printf("\t\tKeep the encoded corpus in <file> and reuse it in later runs with the same vocabulary\n");
+    printf("\t-kernel <name>\n");
+    printf("\t\tUse the scalar, sse2, avx2 or avx512 training kernels; default is auto (the best the CPU supports)\n");
+    printf("\t-sigmoid <int>\n");
+    printf("\t\tCompute the sigmoid with a vector kernel instead of looking it up in a table; default is 0 (table)\n");
+    printf("\t-shared-negatives <int>\n");
+    printf("\t\tDraw one set of negative examples per target word and train all its context ngrams against it\n");
+    printf("\t\tin dense blocks; default is 0 (a set per context ngram)\n");
+    printf("\t-pin <int>\n");
+    printf("\t\tPin each training thread to one CPU, with its buffers on that CPU's NUMA node; default is 0 (off)\n");
+    printf("\t-checkpoint <file>\n");
+    printf("\t\tSave the model and the training position to <file> during training\n");
+    printf("\t-checkpoint-interval <int>\n");
+    printf("\t\tSeconds between checkpoints; default is 1800\n");
+    printf("\t-resume <int>\n");
+    printf("\t\tContinue training from the -checkpoint file instead of starting over; default is 0 (off)\n");
+    printf("\t-metrics <file>\n");
+    printf("\t\tAppend the progress and the counters of every thread to <file> as JSON lines\n");
+    printf("\t-metrics-interval <int>\n");
+    printf("\t\tSeconds between lines of -metrics; default is 10\n");
+    printf("\t-profile <int>\n");
+    printf("\t\tCount the time stamp cycles of tokenizing, lookups, reading and gradients on a sample; default is 0 (off)\n");
+    printf("\t-max-ngrams <int>\n");
+    printf("\t\tKeep only the <int> most frequent words and ngrams of each higher order; default is 0 (keep all)\n");
+    printf("\t\tWith -stream, the room reserved for each; default is 1000000\n");
+    printf("\t-max-memory <int>\n");
+    printf("\t\tPlan the counting tables and the model to fit in <int> MB, keeping only as many words and ngrams of each\n");
+    printf("\t\torder as fit (and with -stream, reserving room for as many); default is 0 (no limit)\n");
+    printf("\t-buckets <int>\n");
+    printf("\t\tTrain the ngrams of known words that are not in the vocabulary on <int> shared rows, picked by a hash of the\n");
+    printf("\t\tngram; -binary 2 saves them for lookups of rare ngrams; default is 0 (such ngrams are skipped)\n");
+    printf("\t-stream <int>\n");
+    printf("\t\tTrain on the -train file (- for stdin) as it is read, adding words and ngrams to the vocabulary as they\n");
+    printf("\t\tbecome frequent, with -alpha as a constant learning rate; 2 also waits for the file to grow, until SIGINT or\n");
+    printf("\t\tSIGTERM; default is 0 (off)\n");
+    printf("\t-stream-min-count <int>\n");
+    printf("\t\tOccurrences after which -stream adds a word or ngram; default is 5\n");
+    printf("\t-stream-update <int>\n");
+    printf("\t\tWords read between updates of the negative sampler of -stream; default is 1000000\n");
+    printf("\t-storage <name>\n");
+    printf("\t\tKeep the vectors during training as f32 (default), f16 or bf16, which takes half the memory; the arithmetic\n");
+    printf("\t\tis done in f32 and the updates are rounded stochastically\n");
+    printf("\t-storage-outputs <int>\n");
+    printf("\t\tKeep the output weights of negative sampling as -storage too; default is 0 (f32)\n");
+    printf("\t-workers <int>\n");
+    printf("\t\tSplit the -threads and the corpus among <int> processes, each with its own copy of the model, which they\n");
+    printf("\t\tmerge through shared memory; default is 1\n");
+    printf("\t-sync-words <int>\n");
+    printf("\t\tWords a process of -workers trains between merges; default is 20000\n");
+    printf("\t-hot-rows <int>\n");
+    printf("\t\tEvery thread trains its own copy of the <int> most frequent output rows and adds what it learned to the\n");
+    printf("\t\tshared rows every -hot-flush words, instead of all threads writing to them; default is 0 (off). Not with -stream\n");
+    printf("\t-hot-flush <int>\n");
+    printf("\t\tWords a thread trains between flushes of its -hot-rows; default is 1000\n");
     printf("\nExamples:\n");
     printf("./word2vec -train data.txt -output vec.txt -size 200 -window 5 -sample 1e-4 -negative 5 -hs 0 -binary 0 -iter 3\n\n");
     return 0;
@@ -683,15 +4127,35 @@ int main(int argc, char **argv) {
   output_file[0] = 0;
   save_vocab_file[0] = 0;
   read_vocab_file[0] = 0;
+  cache_file[0] = 0;
+  quantize[0] = 0;
+  checkpoint_file[0] = 0;
+  metrics_file[0] = 0;
+  strcpy(kernel_name, "auto");
   ngrams = 1;
   if ((i = ArgPos((char *)"-size", argc, argv)) > 0) layer1_size = atoi(argv[i + 1]);
-  if ((i = ArgPos((char *)"-train", argc, argv)) > 0) strcpy(train_file, argv[i + 1]);
-  if ((i = ArgPos((char *)"-save-ngram_infos", argc, argv)) > 0) strcpy(save_vocab_file, argv[i + 1]);
-  if ((i = ArgPos((char *)"-read-ngram_infos", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-train", argc, argv)) > 0) PathArg(train_file, argv[i + 1], (char *)"-train");
+  if ((i = ArgPos((char *)"-train-list", argc, argv)) > 0) PathArg(train_list, argv[i + 1], (char *)"-train-list");
+  if ((i = ArgPos((char *)"-decompress-threads", argc, argv)) > 0) decompress_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-save-ngram_infos", argc, argv)) > 0) PathArg(save_vocab_file, argv[i + 1], (char *)"-save-ngram_infos");
+  if ((i = ArgPos((char *)"-read-ngram_infos", argc, argv)) > 0) PathArg(read_vocab_file, argv[i + 1], (char *)"-read-ngram_infos");
+  if ((i = ArgPos((char *)"-vocab-binary", argc, argv)) > 0) vocab_binary = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-quantize", argc, argv)) > 0) {
+    if (strcmp(argv[i + 1], "f32") && strcmp(argv[i + 1], "f16") && strcmp(argv[i + 1], "int8")) {
+      printf("ERROR: unknown -quantize %s; use f32, f16 or int8\n", argv[i + 1]);
+      exit(1);
+    }
+    strcpy(quantize, argv[i + 1]);
+  }
+  if ((i = ArgPos((char *)"-precision", argc, argv)) > 0) precision = atoi(argv[i + 1]);
+  if (precision < 0 || precision > 12) {
+    printf("ERROR: -precision must be between 0 and 12\n");
+    exit(1);
+  }
   if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
-  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-output", argc, argv)) > 0) PathArg(output_file, argv[i + 1], (char *)"-output");
   if ((i = ArgPos((char *)"-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
@@ -699,11 +4163,123 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-ngrams", argc, argv)) > 0) ngrams = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-cache", argc, argv)) > 0) PathArg(cache_file, argv[i + 1], (char *)"-cache");
+  if ((i = ArgPos((char *)"-kernel", argc, argv)) > 0) {
+    if (strcmp(argv[i + 1], "auto") && strcmp(argv[i + 1], "scalar") && strcmp(argv[i + 1], "sse2")
+        && strcmp(argv[i + 1], "avx2") && strcmp(argv[i + 1], "avx512")) {
+      printf("ERROR: unknown -kernel %s; use auto, scalar, sse2, avx2 or avx512\n", argv[i + 1]);
+      exit(1);
+    }
+    strcpy(kernel_name, argv[i + 1]);
+  }
+  if ((i = ArgPos((char *)"-sigmoid", argc, argv)) > 0) compute_sigmoid = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-shared-negatives", argc, argv)) > 0) shared_negatives = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-pin", argc, argv)) > 0) pin_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint", argc, argv)) > 0) PathArg(checkpoint_file, argv[i + 1], (char *)"-checkpoint");
+  if ((i = ArgPos((char *)"-checkpoint-interval", argc, argv)) > 0) checkpoint_interval = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-resume", argc, argv)) > 0) resume = atoi(argv[i + 1]);
+  if (resume && checkpoint_file[0] == 0) {
+    printf("ERROR: -resume needs -checkpoint\n");
+    exit(1);
+  }
+  if ((i = ArgPos((char *)"-metrics", argc, argv)) > 0) PathArg(metrics_file, argv[i + 1], (char *)"-metrics");
+  if ((i = ArgPos((char *)"-metrics-interval", argc, argv)) > 0) metrics_interval = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-profile", argc, argv)) > 0) profile = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-max-ngrams", argc, argv)) > 0) max_ngrams = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-max-memory", argc, argv)) > 0) max_memory = atoll(argv[i + 1]) << 20;
+  if ((i = ArgPos((char *)"-buckets", argc, argv)) > 0) buckets = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stream", argc, argv)) > 0) stream = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stream-min-count", argc, argv)) > 0) stream_min_count = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stream-update", argc, argv)) > 0) stream_update = atoll(argv[i + 1]);
+  if (stream_update < 1) {
+    printf("ERROR: -stream-update must be positive\n");
+    exit(1);
+  }
+  if (stream && (hs || negative <= 0)) {
+    printf("ERROR: -stream needs -negative and not -hs, as the Huffman tree cannot grow\n");
+    exit(1);
+  }
+  if ((i = ArgPos((char *)"-storage", argc, argv)) > 0) {
+    if (!strcmp(argv[i + 1], "f16")) storage = STORAGE_F16;
+    else if (!strcmp(argv[i + 1], "bf16")) storage = STORAGE_BF16;
+    else if (strcmp(argv[i + 1], "f32")) {
+      printf("ERROR: unknown -storage %s; use f32, f16 or bf16\n", argv[i + 1]);
+      exit(1);
+    }
+  }
+  if ((i = ArgPos((char *)"-storage-outputs", argc, argv)) > 0) storage_outputs = atoi(argv[i + 1]);
+  if (storage == STORAGE_F32 || negative <= 0) storage_outputs = 0;
+  if ((i = ArgPos((char *)"-workers", argc, argv)) > 0) workers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sync-words", argc, argv)) > 0) sync_words = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hot-rows", argc, argv)) > 0) hot_rows = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-hot-flush", argc, argv)) > 0) hot_flush = atoll(argv[i + 1]);
+  if (workers < 1 || workers > num_threads) {
+    printf("ERROR: -workers must be between 1 and -threads\n");
+    exit(1);
+  }
+  if (workers > 1 && (stream || checkpoint_file[0] != 0)) {
+    printf("ERROR: -workers cannot be used with -stream or -checkpoint\n");
+    exit(1);
+  }
+  if (storage != STORAGE_F32 && (stream || workers > 1)) {
+    printf("ERROR: -storage f16 and bf16 cannot be used with -stream or -workers\n");
+    exit(1);
+  }
+  // Bucket ids follow the vocabulary in the int records of the corpus cache
+  if (buckets < 0 || buckets > 1000000000) {
+    printf("ERROR: -buckets must be between 0 and 1000000000\n");
+    exit(1);
+  }
+  if (vocab_binary && stream) {
+    printf("ERROR: -vocab-binary cannot be used with -stream\n");
+    exit(1);
+  }
+  if (buckets > 0 && stream) {
+    printf("ERROR: -buckets cannot be used with -stream\n");
+    exit(1);
+  }
+  if (hot_rows > 0 && stream) {
+    printf("ERROR: -hot-rows cannot be used with -stream\n");
+    exit(1);
+  }
+  if (hot_rows < 0 || hot_flush < 1) {
+    printf("ERROR: -hot-rows must not be negative and -hot-flush must be positive\n");
+    exit(1);
+  }
+  if (ngrams < 1 || ngrams > MAX_NGRAM) {
+    printf("ERROR: -ngrams must be between 1 and %d\n", MAX_NGRAM);
+    exit(1);
+  }
+  if (max_memory < 0) {
+    printf("ERROR: -max-memory must not be negative\n");
+    exit(1);
+  }
+  if (train_list[0] != 0 && train_file[0] != 0) {
+    printf("ERROR: -train and -train-list cannot be used together\n");
+    exit(1);
+  }
+  InitTextFiles();
+  if (decompress_threads < 1) {
+    printf("ERROR: -decompress-threads must be positive\n");
+    exit(1);
+  }
+  if (text_pipeline && stream == 2) {
+    printf("ERROR: -stream 2 follows one plain file, not a compressed one or -train-list\n");
+    exit(1);
+  }
+  // One malloc arena, so that the memory the counting threads free can be used again
+  if (max_memory > 0) mallopt(M_ARENA_MAX, 1);
+  if (stream && max_ngrams == 0) max_ngrams = max_memory > 0 ? FitNgrams(NULL) : 1000000;
+  if (stream && max_ngrams == 0) {
+    printf("ERROR: -max-memory cannot hold a model of even one word\n");
+    exit(1);
+  }
+  stream_ngram_base = max_ngrams + 1;
   ngram_infos = (struct ngram_info *)calloc(ngram_max_size, sizeof(struct ngram_info));
-  ngram_hash = (int *)calloc(ngram_hash_size, sizeof(int));
+  ngram_words = (int *)calloc(ngram_max_size * ngrams, sizeof(int));
   expTable = (real *)malloc((EXP_TABLE_SIZE + 1) * sizeof(real));
   for (i = 0; i < EXP_TABLE_SIZE; i++) {
-    expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP); // Precompute the exp() neg_table
+    expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP); // Precompute the exp() table
     expTable[i] = expTable[i] / (expTable[i] + 1);                   // Precompute f(x) = x / (x + 1)
   }
   TrainModel();